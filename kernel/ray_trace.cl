@@ -1,13 +1,124 @@
 
+// The node's first child is an offset into the brick buffer instead of a node index
+#define NODE_BRICK 0x01
+
+// The node is completely filled with the palette index in its first child, regardless of its size
+#define NODE_LEAF 0x02
+
+// The node stands in for a page of a streamed octree that is not on the device, with the page's index in its first child
+#define NODE_PAGE 0x04
+
+// The most pages that can be asked for in a single frame
+#define MAX_PAGE_REQUESTS 256
+
+// The counters of a build with -DSTATS, in the order they are stored in the stats buffer.
+// They are followed by a histogram of the steps taken by every primary ray, STATS_BIN_WIDTH steps per bin
+#define STAT_RAYS 0
+#define STAT_HITS 1
+#define STAT_MISSES 2
+#define STAT_STEPS 3
+#define STAT_NODE_FETCHES 4
+#define STAT_PUSHES 5
+#define STAT_POPS 6
+#define STAT_MAX_DEPTH 7
+#define STAT_SHADOW_RAYS 8
+#define STAT_SHADOW_STEPS 9
+#define STAT_COUNT 10
+
+#define STATS_BINS 64
+#define STATS_BIN_WIDTH 4
+
+// The ways of coloring every pixel by the work done for it instead of shading it, must match the host.
+// They are only drawn in a build with -DHEATMAP, everything above HEATMAP_MAX_* is drawn white
+#define HEATMAP_OFF 0
+#define HEATMAP_STEPS 1
+#define HEATMAP_NODE_FETCHES 2
+#define HEATMAP_STACK_DEPTH 3
+#define HEATMAP_SHADOW_STEPS 4
+#define HEATMAP_LEVEL 5
+
+#define HEATMAP_MAX_STEPS 256
+#define HEATMAP_MAX_NODE_FETCHES 128
+#define HEATMAP_MAX_STACK_DEPTH 10
+#define HEATMAP_MAX_SHADOW_STEPS 256
+#define HEATMAP_MAX_LEVEL 12
+
+// Count work done by a ray, only in builds that gather stats or draw heatmaps
+#if defined(STATS) || defined(HEATMAP)
+#define COUNTING
+#define COUNT(stats, counter, n) if (stats) (stats)->counter += (n)
+#define COUNT_MAX(stats, counter, n) if (stats) (stats)->counter = max((stats)->counter, (uint)(n))
+#define COUNT_SET(stats, counter, n) if (stats) (stats)->counter = (n)
+#else
+#define COUNT(stats, counter, n)
+#define COUNT_MAX(stats, counter, n)
+#define COUNT_SET(stats, counter, n)
+#endif
+
+// Features that variants of the kernel are built with or without, through -D options
+#ifndef SHADOWS
+#define SHADOWS 1
+#endif
+
+// The deepest a ray can descend into an octree, the host builds variants that fit the deepest octree in the scene
+#ifndef STACK_SIZE
+#define STACK_SIZE 10
+#endif
+
+// STACK_NODES keeps the parents on the stack so that they don't have to be fetched again when they are popped.
+// LOD stops at nodes that are smaller than LOD times their distance, which are drawn as the first voxel inside them
+
 typedef struct {
     // The logarithmic size of this node
     uchar size;
 
+    // Describes how the children of this node should be interpreted
+    uchar flags;
+
+    // Bit i is set if child i is not empty
+    uchar mask;
+
     // The indices of this node's children.
     // If the index is 0 the child is empty
     uint children[8];
 } Node;
 
+typedef struct {
+    // The world space bounds of the model's voxels
+    float min[3], max[3];
+
+    // Rotation from model space to world space, stored row by row
+    int rotation[9];
+
+    // The world space position of the model's origin
+    int translation[3];
+
+    // The model's animation frames, and how many frames this instance is ahead of the others
+    uint firstFrame, frameCount, frameOffset;
+} Instance;
+
+typedef struct {
+    // The index of the frame's root node
+    uint root;
+
+    // The logarithmic size of the cells used for the frame's empty space distances
+    uint distanceLevel;
+} Frame;
+
+typedef struct {
+    float min[3], max[3];
+
+    // Leaves cover count instances starting at first, inner nodes (count == 0) have children at first and first + 1
+    uint first, count;
+} BvhNode;
+
+// The work done tracing a ray and the rays it spawned, and the logarithmic size of the node it hit (0 for a single voxel)
+typedef struct {
+    uint steps, nodeFetches, pushes, pops, maxDepth;
+    uint shadowRays, shadowSteps;
+    uint level;
+} RayStats;
+
 // Calculate a vector * matrix multiplication
 float4 mul(float4 v, float16 m) {
     return (float4) (
@@ -160,11 +271,168 @@ uint getNextChild(uint prevChildIndex, float3 t1, bool* exitNode) {
 }
 
 
-bool traceOctree(__global Node* voxels, float3 origin, float3 direction, int* iterations, float3* normal, float* distance, float3* color) {
+float3 unpackColor(uint colors) {
+    uchar r = (uchar)((colors >> 0) & 0xff);
+    uchar g = (uchar)((colors >> 8) & 0xff);
+    uchar b = (uchar)((colors >> 16) & 0xff);
+
+    return (float3)((float)r / 255.0f, (float)g / 255.0f, (float)b / 255.0f);
+}
+
+
+// Step through a dense brick using a 3D DDA.
+// The brick's entry and exit times along each axis are given by t0 and t1, mirrored according to dirMask
+bool traceBrick(__global uint* bricks, uint offset, uint level, uint dirMask, float t, float3 t0, float3 t1,
+                float3 direction, RayStats* stats, float3* normal, float* distance, uint* index) {
+    int dim = 1 << level;
+    float3 cellT = (t1 - t0) / (float)dim;
+
+    // Find the cell the ray enters the brick in
+    float tEntry = max(t, max(t0.x, max(t0.y, t0.z)));
+    int3 cell = clamp(convert_int3_rtn((tEntry - t0) / cellT), 0, dim - 1);
+    float3 tNext = t0 + convert_float3(cell + 1) * cellT;
+
+    int axis = 2;
+    if (tEntry == t0.x) axis = 0;
+    else if (tEntry == t0.y) axis = 1;
+
+    __global uint* payload = bricks + offset + (1 << (3 * level - 5));
+
+    while (true) {
+        COUNT(stats, steps, 1);
+
+        // Undo the mirroring to find the actual voxel
+        int3 voxel = cell;
+        if (dirMask & 4) voxel.x = dim - 1 - voxel.x;
+        if (dirMask & 2) voxel.y = dim - 1 - voxel.y;
+        if (dirMask & 1) voxel.z = dim - 1 - voxel.z;
+
+        uint i = (uint)((voxel.x * dim + voxel.y) * dim + voxel.z);
+
+        if ((bricks[offset + (i >> 5)] >> (i & 31)) & 1) {
+            if (distance) *distance = tEntry;
+
+            if (normal) {
+                *normal = (float3)(0.0f);
+
+                if (axis == 0) { normal->x = -sign(direction.x); }
+                if (axis == 1) { normal->y = -sign(direction.y); }
+                if (axis == 2) { normal->z = -sign(direction.z); }
+            }
+
+            if (index) *index = (payload[i >> 2] >> ((i & 3) * 8)) & 0xff;
+
+            return true;
+        }
+
+        // Advance to the closest cell
+        if (tNext.x < tNext.y && tNext.x < tNext.z) {
+            tEntry = tNext.x; tNext.x += cellT.x; axis = 0;
+            if (++cell.x == dim) return false;
+        } else if (tNext.y < tNext.z) {
+            tEntry = tNext.y; tNext.y += cellT.y; axis = 1;
+            if (++cell.y == dim) return false;
+        } else {
+            tEntry = tNext.z; tNext.z += cellT.z; axis = 2;
+            if (++cell.z == dim) return false;
+        }
+    }
+}
+
+
+// Reorder the occupancy bits of a node so that bit i tells if the mirrored child i is occupied
+uint mirrorMask(uint mask, uint dirMask) {
+    if (dirMask & 4) mask = ((mask & 0x0f) << 4) | ((mask & 0xf0) >> 4);
+    if (dirMask & 2) mask = ((mask & 0x33) << 2) | ((mask & 0xcc) >> 2);
+    if (dirMask & 1) mask = ((mask & 0x55) << 1) | ((mask & 0xaa) >> 1);
+    return mask;
+}
+
+
+// The children a ray can still visit after the child at childIndex.
+// A ray only ever enters children with more bits set, so these are the ones containing all of its bits
+uint remainingChildren(uint childIndex) {
+    uint mask = 0xff;
+    if (childIndex & 0b100) mask &= 0xf0;
+    if (childIndex & 0b010) mask &= 0xcc;
+    if (childIndex & 0b001) mask &= 0xaa;
+    return mask;
+}
+
+
+// The normal of the face of a cell the ray enters first
+float3 entryNormal(float3 t0, float3 direction) {
+    float tEntry = max(t0.x, max(t0.y, t0.z));
+    float3 normal = (float3)(0.0f);
+
+    if (tEntry == t0.x) { normal.x = -sign(direction.x); }
+    if (tEntry == t0.y) { normal.y = -sign(direction.y); }
+    if (tEntry == t0.z) { normal.z = -sign(direction.z); }
+
+    return normal;
+}
+
+
+#ifdef LOD
+// The palette index of the first voxel inside a node, found by following the child nearest to the ray's origin
+uint firstVoxel(__global Node* voxels, __global uint* bricks, Node node, uint dirMask, RayStats* stats) {
+    while (!(node.flags & (NODE_LEAF | NODE_BRICK))) {
+        uint occupied = mirrorMask(node.mask, dirMask);
+        if (occupied == 0) return 0;
+
+        uint first = 31 - clz(occupied & -occupied);
+        node = voxels[node.children[first ^ dirMask]];
+        COUNT(stats, nodeFetches, 1);
+    }
+
+    if (node.flags & NODE_LEAF) return node.children[0];
+
+    uint words = 1 << (3 * node.size - 5);
+    __global uint* occupancy = bricks + node.children[0];
+
+    for (uint word = 0; word < words; ++word) {
+        uint bits = occupancy[word];
+        if (bits == 0) continue;
+
+        uint i = 32 * word + 31 - clz(bits & -bits);
+        return (occupancy[words + (i >> 2)] >> ((i & 3) * 8)) & 0xff;
+    }
+
+    return 0;
+}
+#endif
+
+
+// Ask the host to stream in a page that is not on the device, every page is only asked for once
+void requestPage(__global uint* pageFeedback, uint page) {
+    __global uint* requested = pageFeedback + 1 + MAX_PAGE_REQUESTS;
+    if (atomic_xchg(&requested[page], 1) != 0) return;
+
+    uint request = atomic_inc(&pageFeedback[0]);
+    if (request < MAX_PAGE_REQUESTS) {
+        pageFeedback[1 + request] = page;
+    } else {
+        // Too many requests this frame, ask again in the next one
+        atomic_xchg(&requested[page], 0);
+    }
+}
+
+
+// Find the closest voxel along a ray through the octree with its root at the given index, and its palette index.
+// If distances is not NULL, it holds how many empty cells (of the logarithmic size distanceLevel) surround
+// every empty child, which is used to skip over empty space.
+// If pageFeedback is not NULL the octree is streamed: missing pages are asked for and treated as empty,
+// and the slots of resident pages are marked as used (paging is the first slot's node, the nodes per slot,
+// the number of pages and the current frame)
+bool traceOctree(__global Node* voxels, __global uint* bricks, __global uchar* distances, uint distanceLevel,
+                 __global uint* pageFeedback, uint4 paging,
+                 uint root, float3 origin, float3 direction, RayStats* stats,
+                 float3* normal, float* distance, uint* paletteIndex) {
     uint dirMask = (direction.x < 0.0 ? 4 : 0) + (direction.y < 0.0 ? 2 : 0) + (direction.z < 0.0 ? 1 : 0);
 
-    Node root = voxels[0];
-    uint realSize = 1 << root.size;
+    Node rootNode = voxels[root];
+    COUNT(stats, nodeFetches, 1);
+    uint realSize = 1 << rootNode.size;
     float3 t0, t1;
     float t;
     if (voxelIntersection((float3)(0.0), realSize, origin, direction, &t0, &t1)) {
@@ -183,78 +451,153 @@ bool traceOctree(__global Node* voxels, float3 origin, float3 direction, int* it
         typedef struct {
             uint index, childIndex;
             float3 t0, tMid, t1;
+#ifdef STACK_NODES
+            Node node;
+#endif
         } Stack;
 
-        Stack stack[10];
+        Stack stack[STACK_SIZE];
         uint stackLen = 0;
 
-        Node node = root;
-        uint index = 0;
+        Node node = rootNode;
+        uint index = root;
+        uint occupied = mirrorMask(node.mask, dirMask);
 
-        if (iterations) *iterations = 0;
         while (true) {
-            if (iterations) *iterations += 1;
+            COUNT(stats, steps, 1);
 
-            uint childGlobalIndex = node.children[childIndex ^ dirMask];
+            // Leave the node as soon as none of the children left along the ray are occupied
+            bool nodeEmpty = (occupied & remainingChildren(childIndex)) == 0;
+            bool exitNode = nodeEmpty;
 
+            uint nextChild = childIndex;
             float3 t0Child, t1Child;
-            getChildT(childIndex, t0, tMid, t1, &t0Child, &t1Child);
 
-            bool exitNode = false;
-            uint nextChild = getNextChild(childIndex, t1Child, &exitNode);
+            if (!nodeEmpty) {
+                getChildT(childIndex, t0, tMid, t1, &t0Child, &t1Child);
+                nextChild = getNextChild(childIndex, t1Child, &exitNode);
+            }
 
-            if (childGlobalIndex != 0) {
+            if (occupied & (1 << childIndex)) {
+                uint childGlobalIndex = node.children[childIndex ^ dirMask];
                 Node child = voxels[childGlobalIndex];
-
-                // Leaf node
-                if (child.size == 0) {
-                    float tEntry = max(t0Child.x, max(t0Child.y, t0Child.z));
-                    if (distance) *distance = tEntry;
-
-                    if (normal) {
-                        *normal = (float3)(0.0f);
-
-                        if (tEntry == t0Child.x) { normal->x = -sign(direction.x); }
-                        if (tEntry == t0Child.y) { normal->y = -sign(direction.y); }
-                        if (tEntry == t0Child.z) { normal->z = -sign(direction.z); }
+                COUNT(stats, nodeFetches, 1);
+
+                if (pageFeedback) {
+                    if (child.flags & NODE_PAGE) {
+                        // Its mask is empty, so the ray continues as if the page was empty
+                        requestPage(pageFeedback, child.children[0]);
+                    } else if (index < paging.x && childGlobalIndex >= paging.x) {
+                        uint slot = (childGlobalIndex - paging.x) / paging.y;
+                        pageFeedback[1 + MAX_PAGE_REQUESTS + paging.z + slot] = paging.w;
                     }
+                }
 
-                    if (color) {
-                        uint colors = child.children[0];
-                        uchar r = (uchar)((colors >> 0) & 0xff);
-                        uchar g = (uchar)((colors >> 8) & 0xff);
-                        uchar b = (uchar)((colors >> 16) & 0xff);
+                // Leaf node, possibly covering a large uniform region
+                if (child.flags & NODE_LEAF) {
+                    if (distance) *distance = max(t0Child.x, max(t0Child.y, t0Child.z));
+                    if (normal) *normal = entryNormal(t0Child, direction);
 
-                        color->x = (float)r / 255.0f;
-                        color->y = (float)g / 255.0f;
-                        color->z = (float)b / 255.0f;
-                    }
+                    if (paletteIndex) *paletteIndex = child.children[0];
+                    COUNT_SET(stats, level, child.size);
 
                     return true;
                 };
 
-                if (!exitNode) {
-                    // Push the new node to the stack
-                    Stack s;
-                    s.index = index;
-                    s.childIndex = nextChild;
-                    s.t0 = t0;
-                    s.tMid = tMid;
-                    s.t1 = t1;
-
-                    stack[stackLen] = s;
-                    stackLen++;
-                }
+#ifdef LOD
+                // Far away the node covers less than a pixel, so any voxel inside it is as good as the one the ray would hit.
+                // Streamed pages may not be resident, so they are always traced in full
+                float tChild = max(t0Child.x, max(t0Child.y, t0Child.z));
+                if (!pageFeedback && (float)(1 << child.size) < LOD * tChild) {
+                    if (distance) *distance = tChild;
+                    if (normal) *normal = entryNormal(t0Child, direction);
+
+                    if (paletteIndex) *paletteIndex = firstVoxel(voxels, bricks, child, dirMask, stats);
+                    COUNT_SET(stats, level, child.size);
 
-                node = child;
-                index = childGlobalIndex;
-                t0 = t0Child;
-                t1 = t1Child;
-                tMid = 0.5f * (t0Child + t1Child);
+                    return true;
+                }
+#endif
+
+                // Dense brick, if it is missed we continue with the next child
+                if (child.flags & NODE_BRICK) {
+                    if (traceBrick(bricks, child.children[0], child.size, dirMask, t, t0Child, t1Child,
+                                   direction, stats, normal, distance, paletteIndex)) {
+                        COUNT_SET(stats, level, 0);
+                        return true;
+                    }
+                } else {
+                    float3 tMidChild = 0.5f * (t0Child + t1Child);
+                    uint firstGrandChild = firstChild(t, tMidChild);
+                    uint childOccupied = mirrorMask(child.mask, dirMask);
+
+                    // Only descend if the ray can hit anything inside the child
+                    if (childOccupied & remainingChildren(firstGrandChild)) {
+                        if (!exitNode) {
+                            // Push the new node to the stack
+                            Stack s;
+                            s.index = index;
+                            s.childIndex = nextChild;
+                            s.t0 = t0;
+                            s.tMid = tMid;
+                            s.t1 = t1;
+#ifdef STACK_NODES
+                            s.node = node;
+#endif
+
+                            stack[stackLen] = s;
+                            stackLen++;
+
+                            COUNT(stats, pushes, 1);
+                            COUNT_MAX(stats, maxDepth, stackLen);
+                        }
+
+                        node = child;
+                        index = childGlobalIndex;
+                        occupied = childOccupied;
+                        t0 = t0Child;
+                        t1 = t1Child;
+                        tMid = tMidChild;
+
+                        childIndex = firstGrandChild;
+
+                        continue;
+                    }
+                }
+            } else if (distances && !nodeEmpty) {
+                uint emptyDistance = distances[8 * index + (childIndex ^ dirMask)];
+
+                if (emptyDistance > 0) {
+                    // Everything within the distance is empty, so the ray can skip to where it leaves that region
+                    float unit = (float)(1 << distanceLevel) / (float)(1 << (node.size - 1));
+                    float3 tEmpty = t1Child + (float)emptyDistance * unit * (t1Child - t0Child);
+                    t = min(tEmpty.x, min(tEmpty.y, tEmpty.z));
+
+                    // Leave every node the ray has passed through by then
+                    while (t >= min(t1.x, min(t1.y, t1.z))) {
+                        if (stackLen == 0) return false;
+
+                        stackLen--;
+                        index = stack[stackLen].index;
+                        t0 = stack[stackLen].t0;
+                        tMid = stack[stackLen].tMid;
+                        t1 = stack[stackLen].t1;
+#ifdef STACK_NODES
+                        node = stack[stackLen].node;
+#endif
+
+                        COUNT(stats, pops, 1);
+                    }
 
-                childIndex = firstChild(t, tMid);
+#ifndef STACK_NODES
+                    node = voxels[index];
+                    COUNT(stats, nodeFetches, 1);
+#endif
+                    occupied = mirrorMask(node.mask, dirMask);
+                    childIndex = firstChild(t, tMid);
 
-                continue;
+                    continue;
+                }
             }
 
             if (exitNode) {
@@ -273,7 +616,15 @@ bool traceOctree(__global Node* voxels, float3 origin, float3 direction, int* it
                 t1 = s.t1;
 
 
+#ifdef STACK_NODES
+                node = s.node;
+#else
                 node = voxels[index];
+                COUNT(stats, nodeFetches, 1);
+#endif
+                occupied = mirrorMask(node.mask, dirMask);
+
+                COUNT(stats, pops, 1);
 
                 continue;
             }
@@ -289,7 +640,241 @@ bool traceOctree(__global Node* voxels, float3 origin, float3 direction, int* it
 }
 
 
-__kernel void ray_trace(__write_only image2d_t pixels, float16 invMatrix, float3 eye, float time, float3 lightDirection, __global Node* voxels) {
+// Find where a ray enters an axis aligned box, if it does so before tMax
+bool boxIntersection(__global float* boxMin, __global float* boxMax, float3 origin, float3 invDirection, float tMax, float* tEntry) {
+    float3 t0 = ((float3)(boxMin[0], boxMin[1], boxMin[2]) - origin) * invDirection;
+    float3 t1 = ((float3)(boxMax[0], boxMax[1], boxMax[2]) - origin) * invDirection;
+
+    float3 tNear = fmin(t0, t1);
+    float3 tFar = fmax(t0, t1);
+
+    float entry = max(0.0f, max(tNear.x, max(tNear.y, tNear.z)));
+    float exit = min(tMax, min(tFar.x, min(tFar.y, tFar.z)));
+
+    *tEntry = entry;
+    return entry <= exit;
+}
+
+
+// Add the work done by a ray traced on behalf of another, and take over its level if it was hit
+void addStats(RayStats* stats, RayStats* other, bool hit) {
+#ifdef COUNTING
+    if (!stats) return;
+
+    stats->steps += other->steps;
+    stats->nodeFetches += other->nodeFetches;
+    stats->pushes += other->pushes;
+    stats->pops += other->pops;
+    stats->maxDepth = max(stats->maxDepth, other->maxDepth);
+    stats->shadowRays += other->shadowRays;
+    stats->shadowSteps += other->shadowSteps;
+    if (hit) stats->level = other->level;
+#endif
+}
+
+
+// Find the closest voxel of any instance along a ray, closer than maxDistance.
+// Animated instances show the given frame of their animation.
+// If distance is NULL the first hit is returned, which is enough for shadows
+bool traceInstances(__global Node* nodes, __global uint* bricks, __global uchar* distances,
+                    __global Instance* instances, __global BvhNode* bvh, uint bvhSize, __global Frame* frames, uint frame,
+                    float3 origin, float3 direction, float maxDistance, RayStats* stats,
+                    float3* normal, float* distance, uint* paletteIndex) {
+    if (bvhSize == 0) return false;
+
+    float3 invDirection = 1.0f / direction;
+    float closest = maxDistance;
+    bool hit = false;
+
+    uint stack[32];
+    uint stackLen = 0;
+    stack[stackLen++] = 0;
+
+    while (stackLen > 0) {
+        __global BvhNode* node = &bvh[stack[--stackLen]];
+
+        float tEntry;
+        if (!boxIntersection(node->min, node->max, origin, invDirection, closest, &tEntry)) continue;
+
+        if (node->count == 0) {
+            stack[stackLen++] = node->first;
+            stack[stackLen++] = node->first + 1;
+            continue;
+        }
+
+        for (uint i = node->first; i < node->first + node->count; ++i) {
+            __global Instance* instance = &instances[i];
+            if (!boxIntersection(instance->min, instance->max, origin, invDirection, closest, &tEntry)) continue;
+
+            // The rotation only swaps and flips axes, so its inverse is its transpose
+            __global int* r = instance->rotation;
+            float3 relative = origin - (float3)(instance->translation[0], instance->translation[1], instance->translation[2]);
+
+            float3 localOrigin = (float3)(
+                r[0] * relative.x + r[3] * relative.y + r[6] * relative.z,
+                r[1] * relative.x + r[4] * relative.y + r[7] * relative.z,
+                r[2] * relative.x + r[5] * relative.y + r[8] * relative.z
+            );
+
+            float3 localDirection = (float3)(
+                r[0] * direction.x + r[3] * direction.y + r[6] * direction.z,
+                r[1] * direction.x + r[4] * direction.y + r[7] * direction.z,
+                r[2] * direction.x + r[5] * direction.y + r[8] * direction.z
+            );
+
+            Frame current = frames[instance->firstFrame + (frame + instance->frameOffset) % instance->frameCount];
+
+            float3 localNormal;
+            float localDistance;
+            uint localIndex;
+            RayStats localStats = {0, 0, 0, 0, 0, 0, 0, 0};
+
+            bool localHit = traceOctree(nodes, bricks, distances, current.distanceLevel, NULL, (uint4)(0), current.root,
+                                        localOrigin, localDirection, &localStats, &localNormal, &localDistance, &localIndex);
+
+            // Only the closest hit decides the level
+            addStats(stats, &localStats, localHit && localDistance < closest);
+            if (!localHit || localDistance >= closest) continue;
+
+            if (!distance) return true;
+
+            hit = true;
+            closest = localDistance;
+
+            if (normal) {
+                *normal = (float3)(
+                    r[0] * localNormal.x + r[1] * localNormal.y + r[2] * localNormal.z,
+                    r[3] * localNormal.x + r[4] * localNormal.y + r[5] * localNormal.z,
+                    r[6] * localNormal.x + r[7] * localNormal.y + r[8] * localNormal.z
+                );
+            }
+
+            if (paletteIndex) *paletteIndex = localIndex;
+        }
+    }
+
+    if (hit) *distance = closest;
+    return hit;
+}
+
+
+// The world octree, and the instances of shared models placed in it
+typedef struct {
+    __global Node* voxels;
+    __global uint* bricks;
+    __global uchar* distances;
+    uint distanceLevel;
+    __global uint* pageFeedback;
+    uint4 paging;
+
+    __global Node* modelNodes;
+    __global uint* modelBricks;
+    __global uchar* modelDistances;
+    __global Instance* instances;
+    __global BvhNode* bvh;
+    uint bvhSize;
+    __global Frame* frames;
+    uint frame;
+} Scene;
+
+
+// Find the closest voxel in the world or any instance.
+// If distance is NULL the first hit is returned, which is enough for shadows
+bool traceScene(Scene* scene, float3 origin, float3 direction, RayStats* stats,
+                float3* normal, float* distance, uint* paletteIndex) {
+    float worldDistance;
+    bool hitWorld = traceOctree(scene->voxels, scene->bricks, scene->distances, scene->distanceLevel,
+                                scene->pageFeedback, scene->paging, 0, origin, direction,
+                                stats, normal, &worldDistance, paletteIndex);
+
+    if (hitWorld && !distance) return true;
+
+    // Instances only need to be closer than the world
+    float instanceDistance;
+    bool hitInstance = traceInstances(scene->modelNodes, scene->modelBricks, scene->modelDistances, scene->instances,
+                                      scene->bvh, scene->bvhSize, scene->frames, scene->frame, origin, direction,
+                                      hitWorld ? worldDistance : INFINITY, stats, normal, &instanceDistance, paletteIndex);
+
+    if (distance) *distance = hitInstance ? instanceDistance : worldDistance;
+    return hitWorld || hitInstance;
+}
+
+
+// Add the work done by a shadow ray to the ray that cast it, its steps are counted separately
+void addShadowStats(RayStats* stats, RayStats* shadow) {
+#ifdef COUNTING
+    if (!stats) return;
+
+    stats->shadowRays += 1;
+    stats->shadowSteps += shadow->steps;
+    stats->nodeFetches += shadow->nodeFetches;
+    stats->pushes += shadow->pushes;
+    stats->pops += shadow->pops;
+    stats->maxDepth = max(stats->maxDepth, shadow->maxDepth);
+#endif
+}
+
+
+// Map a value between 0 and 1 to a fixed scale running from black through blue, green and yellow to red.
+// Values above 1 are white, so that they stand out
+float3 heatColor(float value) {
+    if (value > 1.0f) return (float3)(1.0f);
+
+    const float3 scale[5] = {
+        (float3)(0.0f, 0.0f, 0.0f),
+        (float3)(0.0f, 0.0f, 1.0f),
+        (float3)(0.0f, 1.0f, 0.0f),
+        (float3)(1.0f, 1.0f, 0.0f),
+        (float3)(1.0f, 0.0f, 0.0f)
+    };
+
+    float position = max(value, 0.0f) * 4.0f;
+    int lower = min((int)position, 3);
+
+    return mix(scale[lower], scale[lower + 1], position - (float)lower);
+}
+
+
+// The color of a pixel in a heatmap, misses are drawn dark gray when showing the level they hit
+float3 heatmapColor(uint heatmap, RayStats* stats, bool hit, uint level) {
+    switch (heatmap) {
+        case HEATMAP_STEPS: return heatColor((float)stats->steps / HEATMAP_MAX_STEPS);
+        case HEATMAP_NODE_FETCHES: return heatColor((float)stats->nodeFetches / HEATMAP_MAX_NODE_FETCHES);
+        case HEATMAP_STACK_DEPTH: return heatColor((float)stats->maxDepth / HEATMAP_MAX_STACK_DEPTH);
+        case HEATMAP_SHADOW_STEPS: return heatColor((float)stats->shadowSteps / HEATMAP_MAX_SHADOW_STEPS);
+        case HEATMAP_LEVEL: return hit ? heatColor((float)level / HEATMAP_MAX_LEVEL) : (float3)(0.1f);
+        default: return (float3)(0.0f);
+    }
+}
+
+
+// The color of a voxel lit by the sun
+float3 shade(Scene* scene, float3 position, float3 normal, float3 lightDirection, float3 albedo, RayStats* stats) {
+    float diff = max(0.0, 0.8 * dot(normal, lightDirection));
+
+    float shadow = 1.0;
+#if SHADOWS
+    if (diff > 0.0f) {
+        RayStats shadowStats = {0, 0, 0, 0, 0, 0, 0, 0};
+
+        if (traceScene(scene, position, lightDirection, &shadowStats, NULL, NULL, NULL)) {
+            shadow -= 0.5;
+        }
+
+        addShadowStats(stats, &shadowStats);
+    }
+#endif
+
+    return albedo * (diff * shadow + 0.1f);
+}
+
+
+__kernel void ray_trace(__write_only image2d_t pixels, float16 invMatrix, float3 eye, float time, float3 lightDirection, __global Node* voxels,
+                        __global uint* bricks, __constant uint* palette, __global uchar* distances, uint distanceLevel,
+                        __global Node* modelNodes, __global uint* modelBricks, __global uchar* modelDistances,
+                        __global Instance* instances, __global BvhNode* bvh, uint bvhSize, __global Frame* frames, uint frame,
+                        __constant float4* materials, __global uint* pageFeedback, uint4 paging, __global uint* stats,
+                        uint heatmap) {
     const int x = get_global_id(0);
     const int y = get_global_id(1);
 
@@ -302,32 +887,57 @@ __kernel void ray_trace(__write_only image2d_t pixels, float16 invMatrix, float3
 
     float3 direction = ray_direction(screen_x, screen_y, invMatrix);
 
+    Scene scene = {
+        voxels, bricks, distances, distanceLevel, pageFeedback, paging,
+        modelNodes, modelBricks, modelDistances, instances, bvh, bvhSize, frames, frame
+    };
 
-    float4 color = (float4)(0.0, 0.0, 0.0, 1.0);
 
-    float3 center = (float3)(0.0, 0.0, 3.0);
+    float4 color = (float4)(0.0, 0.0, 0.0, 1.0);
 
-    float3 normal, voxelColor;
+    float3 normal;
     float distance = 0.0f;
+    uint index;
 
     // Test for intersection with root
-    int iterations = 0;
+    RayStats rayStats = {0, 0, 0, 0, 0, 0, 0, 0};
     color.xyz = fabs(direction);
-    if (traceOctree(voxels, eye, direction, &iterations, &normal, &distance, &voxelColor)) {
-        float3 hit = eye + distance * direction + normal * 1e-4f;
 
-        float diff = max(0.0, 0.8 * dot(normal, lightDirection));
+    bool hit = traceScene(&scene, eye, direction, &rayStats, &normal, &distance, &index);
+    uint level = rayStats.level;
 
-        float shadow = 1.0;
-        if (traceOctree(voxels, hit, lightDirection, NULL, NULL, NULL, NULL)) {
-            shadow -= 0.5;
-        }
+    if (hit) {
+        float3 hitPosition = eye + distance * direction + normal * 1e-4f;
 
-        color.xyz = voxelColor * (max(0.0f, diff) * shadow + 0.1f);
-    } else {
-        color.xyz *= (float)iterations / 50.0f;
+        // x: metal, y: glass, z: emission
+        float4 material = materials[index];
+        float3 albedo = unpackColor(palette[index]);
+
+        color.xyz = shade(&scene, hitPosition, normal, lightDirection, albedo, &rayStats) + albedo * material.z;
+
+        // Metal and glass reflect a single bounce, glass is not refracted
+        float reflectance = material.x + 0.5f * material.y;
+        if (reflectance > 0.0f) {
+            float3 reflected = reflect(direction, normal);
+            float3 reflectedColor = fabs(reflected);
+
+            float3 reflectedNormal;
+            float reflectedDistance;
+            uint reflectedIndex;
+
+            if (traceScene(&scene, hitPosition, reflected, &rayStats, &reflectedNormal, &reflectedDistance, &reflectedIndex)) {
+                float3 reflectedHit = hitPosition + reflectedDistance * reflected + reflectedNormal * 1e-4f;
+                reflectedColor = shade(&scene, reflectedHit, reflectedNormal, lightDirection, unpackColor(palette[reflectedIndex]), &rayStats);
+            }
+
+            color.xyz = mix(color.xyz, reflectedColor * albedo, min(reflectance, 1.0f));
+        }
     }
 
+#ifdef HEATMAP
+    if (heatmap != HEATMAP_OFF) color.xyz = heatmapColor(heatmap, &rayStats, hit, level);
+#endif
+
 
     /*
     float3 normal = (float3)(1.0, 1.0, 1.0);
@@ -375,5 +985,38 @@ __kernel void ray_trace(__write_only image2d_t pixels, float16 invMatrix, float3
         (int2)(x, y),
         color
     );
+
+#ifdef STATS
+    // Sum up the work group in local memory first, so that the global counters are only touched once per group
+    __local uint groupStats[STAT_COUNT + STATS_BINS];
+
+    const uint local = get_local_id(1) * get_local_size(0) + get_local_id(0);
+    const uint localSize = get_local_size(0) * get_local_size(1);
+
+    for (uint i = local; i < STAT_COUNT + STATS_BINS; i += localSize) groupStats[i] = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    atomic_inc(&groupStats[STAT_RAYS]);
+    atomic_inc(&groupStats[hit ? STAT_HITS : STAT_MISSES]);
+    atomic_add(&groupStats[STAT_STEPS], rayStats.steps);
+    atomic_add(&groupStats[STAT_NODE_FETCHES], rayStats.nodeFetches);
+    atomic_add(&groupStats[STAT_PUSHES], rayStats.pushes);
+    atomic_add(&groupStats[STAT_POPS], rayStats.pops);
+    atomic_max(&groupStats[STAT_MAX_DEPTH], rayStats.maxDepth);
+    atomic_add(&groupStats[STAT_SHADOW_RAYS], rayStats.shadowRays);
+    atomic_add(&groupStats[STAT_SHADOW_STEPS], rayStats.shadowSteps);
+    atomic_inc(&groupStats[STAT_COUNT + min(rayStats.steps / STATS_BIN_WIDTH, (uint)(STATS_BINS - 1))]);
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint i = local; i < STAT_COUNT + STATS_BINS; i += localSize) {
+        if (groupStats[i] == 0) continue;
+
+        if (i == STAT_MAX_DEPTH) {
+            atomic_max(&stats[i], groupStats[i]);
+        } else {
+            atomic_add(&stats[i], groupStats[i]);
+        }
+    }
+#endif
 }
 
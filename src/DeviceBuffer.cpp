@@ -0,0 +1,71 @@
+#include "DeviceBuffer.h"
+
+
+/// The smallest buffer that is ever allocated, in bytes
+const size_t MIN_CAPACITY = 4096;
+
+
+DeviceBuffer::DeviceBuffer(cl_context context, cl_command_queue queue, cl_mem_flags flags) :
+        context(context), queue(queue), buffer(nullptr), flags(flags), capacity(0), size(0) {
+    this->reserve(MIN_CAPACITY);
+}
+
+DeviceBuffer::~DeviceBuffer() {
+    if (this->buffer) clReleaseMemObject(this->buffer);
+}
+
+bool DeviceBuffer::reserve(size_t bytes) {
+    if (bytes <= this->capacity) return false;
+
+    // Grow geometrically so that a buffer growing by small steps is only reallocated a logarithmic number of times
+    size_t newCapacity = this->capacity < MIN_CAPACITY ? MIN_CAPACITY : this->capacity;
+    while (newCapacity < bytes) newCapacity *= 2;
+
+    cl_int error;
+    cl_mem newBuffer = clCreateBuffer(this->context, this->flags, newCapacity, nullptr, &error);
+    checkCLError(error);
+
+    if (this->buffer) {
+        if (this->size > 0) {
+            error = clEnqueueCopyBuffer(this->queue, this->buffer, newBuffer, 0, 0, this->size, 0, nullptr, nullptr);
+            checkCLError(error);
+        }
+
+        // The old buffer is kept alive by the copy until it has completed
+        clReleaseMemObject(this->buffer);
+    }
+
+    LOG(DEBUG) << "Device buffer grew from " << this->capacity << " to " << newCapacity << " bytes";
+
+    this->buffer = newBuffer;
+    this->capacity = newCapacity;
+    return true;
+}
+
+bool DeviceBuffer::upload(const void* data, size_t count, size_t elementSize, const std::vector<Range>& ranges) {
+    bool replaced = this->reserve(count * elementSize);
+
+    auto bytes = static_cast<const char*>(data);
+    for (const Range& range : ranges) {
+        cl_int error = clEnqueueWriteBuffer(this->queue, this->buffer, CL_FALSE,
+                                            range.first * elementSize, range.count * elementSize,
+                                            bytes + range.first * elementSize, 0, nullptr, nullptr);
+        checkCLError(error);
+    }
+
+    this->size = count * elementSize;
+    return replaced;
+}
+
+void DeviceBuffer::bind(cl_kernel kernel, cl_uint argIndex) const {
+    cl_int error = clSetKernelArg(kernel, argIndex, sizeof(this->buffer), &this->buffer);
+    checkCLError(error);
+}
+
+cl_mem DeviceBuffer::get() const {
+    return this->buffer;
+}
+
+size_t DeviceBuffer::getCapacity() const {
+    return this->capacity;
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "OpenCL.h"
+#include "Octree.h"
+
+
+/// A device buffer that mirrors a growing host buffer.
+///
+/// More memory than needed is allocated so that the buffer can grow without being recreated every time.
+/// When the capacity is exceeded a larger buffer is allocated and the old contents are copied over on the device.
+class DeviceBuffer {
+    cl_context context;
+    cl_command_queue queue;
+
+    cl_mem buffer;
+    cl_mem_flags flags;
+
+    /// The number of bytes allocated on the device, and the number of those that hold data
+    size_t capacity, size;
+
+public:
+
+    DeviceBuffer(cl_context context, cl_command_queue queue, cl_mem_flags flags = CL_MEM_READ_ONLY);
+    ~DeviceBuffer();
+
+    DeviceBuffer(const DeviceBuffer&) = delete;
+    DeviceBuffer& operator=(const DeviceBuffer&) = delete;
+
+    /// Make room for at least `bytes` bytes, keeping the current contents.
+    /// Returns true if the underlying buffer was replaced.
+    bool reserve(size_t bytes);
+
+    /// Upload the given ranges of elements from the host mirror, which has `count` elements in total.
+    /// Returns true if the underlying buffer was replaced and has to be bound again.
+    bool upload(const void* data, size_t count, size_t elementSize, const std::vector<Range>& ranges);
+
+    /// Bind the buffer to an argument of a kernel
+    void bind(cl_kernel kernel, cl_uint argIndex) const;
+
+    cl_mem get() const;
+    size_t getCapacity() const;
+};
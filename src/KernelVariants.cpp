@@ -0,0 +1,226 @@
+#include "KernelVariants.h"
+
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <chrono>
+
+#include "Log.h"
+#include "Trace.h"
+
+
+KernelFeatures::KernelFeatures() :
+        shadows(true), stackNodes(false), stackSize(10), lod(0.0f), stats(false), heatmap(false) {}
+
+std::string KernelFeatures::getOptions() const {
+    std::ostringstream options;
+
+    options << "-DSHADOWS=" << (this->shadows ? 1 : 0) << " -DSTACK_SIZE=" << this->stackSize;
+    if (this->stackNodes) options << " -DSTACK_NODES";
+    if (this->lod > 0.0f) options << " -DLOD=" << std::scientific << this->lod << "f";
+    if (this->stats) options << " -DSTATS";
+    if (this->heatmap) options << " -DHEATMAP";
+
+    return options.str();
+}
+
+
+/// Read a whole file, returns false if it can't be opened
+static bool readSource(const std::string& path, std::string* source) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    *source = contents.str();
+
+    return true;
+}
+
+
+/// Called by the implementation when a build in the background has finished, whether it succeeded or not
+static void CL_CALLBACK buildFinished(cl_program /*program*/, void* done) {
+    static_cast<std::atomic<bool>*>(done)->store(true);
+}
+
+
+KernelVariants::KernelVariants(cl_context context, cl_device_id device, const std::string& path,
+                               const std::string& kernelName) :
+        context(context), device(device), path(path), kernelName(kernelName), modified{}, version(0) {
+    struct stat info{};
+    if (stat(path.c_str(), &info) == 0) this->modified = info.st_mtim;
+
+    if (!readSource(path, &this->source)) throw std::runtime_error("Failed to open file: " + path);
+}
+
+KernelVariants::~KernelVariants() {
+    // The builds' callbacks must not be called after they are gone
+    for (auto& build : this->builds) {
+        while (!build.second->done) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        build.second->thread.join();
+        if (build.second->program) clReleaseProgram(build.second->program);
+    }
+
+    for (auto& variant : this->variants) {
+        clReleaseKernel(variant.second.kernel);
+        clReleaseProgram(variant.second.program);
+    }
+}
+
+void KernelVariants::logBuildFailure(cl_program program) const {
+    size_t length;
+    clGetProgramBuildInfo(program, this->device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &length);
+
+    std::vector<char> log(length + 1, '\0');
+    clGetProgramBuildInfo(program, this->device, CL_PROGRAM_BUILD_LOG, length, log.data(), nullptr);
+
+    LOG(ERROR) << log.data();
+}
+
+cl_kernel KernelVariants::get(const KernelFeatures& features) {
+    std::string options = features.getOptions();
+
+    auto existing = this->variants.find(options);
+    if (existing != this->variants.end()) return existing->second.kernel;
+
+    auto failure = this->failures.find(options);
+    if (failure != this->failures.end() && failure->second == this->version) return nullptr;
+
+    LOG(INFO) << "Building kernel with " << options << "...";
+
+    cl_int error;
+    const char* sources = this->source.c_str();
+    cl_program program = clCreateProgramWithSource(this->context, 1, &sources, nullptr, &error);
+    checkCLError(error);
+
+    int64_t buildStart = Trace::now();
+    error = clBuildProgram(program, 1, &this->device, options.c_str(), nullptr, nullptr);
+    Trace::addHostSpan("clBuildProgram", buildStart, Trace::now());
+
+    cl_kernel kernel = nullptr;
+    if (error == CL_SUCCESS) {
+        kernel = clCreateKernel(program, this->kernelName.c_str(), &error);
+    } else if (error == CL_BUILD_PROGRAM_FAILURE) {
+        this->logBuildFailure(program);
+    }
+
+    if (error != CL_SUCCESS) {
+        LOG(ERROR) << "Failed to build kernel with " << options << ": " << error;
+        clReleaseProgram(program);
+
+        this->failures[options] = this->version;
+        return nullptr;
+    }
+
+    this->variants[options] = Variant{program, kernel, this->version};
+    this->failures.erase(options);
+    LOG(INFO) << "Kernel built!";
+
+    return kernel;
+}
+
+void KernelVariants::startBuild(const std::string& options) {
+    std::unique_ptr<Build> build(new Build());
+    build->program = nullptr;
+    build->version = this->version;
+    build->done = false;
+
+    // clBuildProgram may not return until the build is done, so it is called on a thread of its own
+    Build* pending = build.get();
+    cl_context context = this->context;
+    cl_device_id device = this->device;
+    std::string source = this->source;
+
+    build->thread = std::thread([pending, context, device, source, options]() {
+        cl_int error;
+        const char* sources = source.c_str();
+        cl_program program = clCreateProgramWithSource(context, 1, &sources, nullptr, &error);
+
+        if (error != CL_SUCCESS) {
+            pending->done = true;
+            return;
+        }
+
+        pending->program = program;
+
+        // A build that fails right away never calls back
+        error = clBuildProgram(program, 1, &device, options.c_str(), buildFinished, &pending->done);
+        if (error != CL_SUCCESS) pending->done = true;
+    });
+
+    this->builds[options] = std::move(build);
+}
+
+void KernelVariants::finishBuild(const std::string& options, Build& build) {
+    Variant& variant = this->variants[options];
+    variant.version = build.version;
+
+    if (!build.program) {
+        LOG(ERROR) << "Failed to create program for kernel with " << options;
+        return;
+    }
+
+    cl_build_status status = CL_BUILD_ERROR;
+    clGetProgramBuildInfo(build.program, this->device, CL_PROGRAM_BUILD_STATUS, sizeof(status), &status, nullptr);
+
+    cl_int error = CL_BUILD_PROGRAM_FAILURE;
+    cl_kernel kernel = nullptr;
+
+    if (status == CL_BUILD_SUCCESS) {
+        kernel = clCreateKernel(build.program, this->kernelName.c_str(), &error);
+    } else {
+        this->logBuildFailure(build.program);
+    }
+
+    if (error != CL_SUCCESS) {
+        LOG(ERROR) << "Failed to reload kernel with " << options << ", keeping the previous one";
+        clReleaseProgram(build.program);
+        return;
+    }
+
+    clReleaseKernel(variant.kernel);
+    clReleaseProgram(variant.program);
+
+    variant.program = build.program;
+    variant.kernel = kernel;
+
+    LOG(INFO) << "Reloaded kernel with " << options;
+}
+
+void KernelVariants::update() {
+    // Swap in the builds that have finished, this is the only place a variant's kernel changes
+    for (auto build = this->builds.begin(); build != this->builds.end();) {
+        if (!build->second->done) {
+            ++build;
+            continue;
+        }
+
+        build->second->thread.join();
+        this->finishBuild(build->first, *build->second);
+
+        build = this->builds.erase(build);
+    }
+
+    // Editors may touch the file without changing it, so only a different source is a new version
+    struct stat info{};
+    if (stat(this->path.c_str(), &info) == 0 &&
+        (info.st_mtim.tv_sec != this->modified.tv_sec || info.st_mtim.tv_nsec != this->modified.tv_nsec)) {
+        this->modified = info.st_mtim;
+
+        std::string source;
+        if (readSource(this->path, &source) && source != this->source) {
+            this->source = source;
+            this->version++;
+
+            LOG(INFO) << this->path << " changed, building " << this->variants.size() << " kernel(s) again";
+        }
+    }
+
+    // A variant that is still being built from an older version is built again once that build is done
+    for (auto& variant : this->variants) {
+        if (variant.second.version < this->version && this->builds.find(variant.first) == this->builds.end()) {
+            this->startBuild(variant.first);
+        }
+    }
+}
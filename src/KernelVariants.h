@@ -0,0 +1,103 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "OpenCL.h"
+
+
+/// The features a variant of the kernel is built with. Features that are off are compiled out instead of
+/// being branched on for every ray, must match the kernel's -D options
+struct KernelFeatures {
+    /// Cast a shadow ray from every hit that faces the sun
+    bool shadows;
+
+    /// Keep the parents of a node on the stack, so that they don't have to be fetched again when it is popped
+    bool stackNodes;
+
+    /// The deepest a ray can descend into an octree
+    uint stackSize;
+
+    /// Stop at nodes smaller than `lod` times their distance, 0 to always trace down to single voxels
+    float lod;
+
+    /// Count the work done by every ray, for `--stats` and heatmaps respectively
+    bool stats, heatmap;
+
+    KernelFeatures();
+
+    /// The options the kernel is built with
+    std::string getOptions() const;
+};
+
+
+/// Builds variants of a kernel from the same source, and keeps every variant that has been built.
+///
+/// Variants are built the first time they are asked for, switching back to one is free.
+/// Arguments are set per kernel, so they have to be set again after switching.
+///
+/// The source file is watched, and when it changes every variant is built again in the background.
+/// A variant is only replaced once its new build has succeeded, until then, or if it fails, the old one is kept.
+class KernelVariants {
+    struct Variant {
+        cl_program program;
+        cl_kernel kernel;
+
+        /// The version of the source the variant was last built from, even if that build failed
+        size_t version;
+    };
+
+    /// A build running in the background, `done` is set by the build's callback
+    struct Build {
+        cl_program program;
+        size_t version;
+        std::atomic<bool> done;
+        std::thread thread;
+    };
+
+    cl_context context;
+    cl_device_id device;
+
+    std::string path, source, kernelName;
+
+    /// When the source file was last changed, and how many times it has been loaded
+    timespec modified;
+    size_t version;
+
+    /// The variants that have been built and the ones being built again, by their build options
+    std::map<std::string, Variant> variants;
+    std::map<std::string, std::unique_ptr<Build>> builds;
+
+    /// The version of the source that variants which have never been built successfully last failed with
+    std::map<std::string, size_t> failures;
+
+    /// Log why a program failed to build
+    void logBuildFailure(cl_program program) const;
+
+    /// Start building a variant again from the current source
+    void startBuild(const std::string& options);
+
+    /// Replace a variant with its finished build, if it succeeded
+    void finishBuild(const std::string& options, Build& build);
+
+public:
+
+    KernelVariants(cl_context context, cl_device_id device, const std::string& path, const std::string& kernelName);
+    ~KernelVariants();
+
+    KernelVariants(const KernelVariants&) = delete;
+    KernelVariants& operator=(const KernelVariants&) = delete;
+
+    /// Get the kernel of a variant, building it if it hasn't been already.
+    /// Returns null if the build fails, which is not tried again until the source changes
+    cl_kernel get(const KernelFeatures& features);
+
+    /// Swap in the variants whose builds have finished, and start building them again if the source has changed.
+    /// Call between frames, kernels returned by `get` may be replaced and released
+    void update();
+};
@@ -4,6 +4,13 @@
 
 #include "Log.h"
 
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
 
 LoggingLevel Log::reportingLevel = LoggingLevel ::WARNING;
 
@@ -19,6 +26,118 @@ std::string toString(LoggingLevel level) {
 }
 
 
+/// The number of messages the asynchronous sink can hold, must be a power of two, and the longest message
+const size_t LOG_SLOTS = 1024;
+const size_t LOG_MESSAGE_SIZE = 256;
+
+
+/// A message waiting in the ring buffer.
+///
+/// A slot can be claimed by a writer when its sequence equals the writer's position,
+/// and read when it equals the position plus one.
+struct LogSlot {
+    std::atomic<size_t> sequence;
+    LoggingLevel level;
+    size_t length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+static LogSlot logSlots[LOG_SLOTS];
+static std::atomic<size_t> logTail(0);
+static size_t logHead = 0;
+
+static std::atomic<bool> logAsync(false), logRunning(false);
+static std::atomic<size_t> logDropped(0);
+static std::thread logThread;
+
+
+/// Write a message to the console
+static void printMessage(LoggingLevel level, const char* text, size_t length) {
+    if (level >= LoggingLevel::WARNING) {
+        std::clog.write(text, length);
+    } else {
+        std::cout.write(text, length);
+    }
+}
+
+/// Try to put a message in the ring buffer, returns false if it is full
+static bool pushMessage(LoggingLevel level, const std::string& text) {
+    size_t position = logTail.load(std::memory_order_relaxed);
+    LogSlot* slot;
+
+    while (true) {
+        slot = &logSlots[position & (LOG_SLOTS - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+
+        if (difference == 0) {
+            if (logTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if (difference < 0) {
+            return false;
+        } else {
+            position = logTail.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    slot->length = std::min(text.size(), LOG_MESSAGE_SIZE);
+    std::memcpy(slot->text, text.data(), slot->length);
+
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+/// Print every message in the ring buffer, returns false if there were none
+static bool drainMessages() {
+    bool printed = false;
+
+    while (true) {
+        LogSlot& slot = logSlots[logHead & (LOG_SLOTS - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != logHead + 1) break;
+
+        printMessage(slot.level, slot.text, slot.length);
+
+        slot.sequence.store(logHead + LOG_SLOTS, std::memory_order_release);
+        logHead++;
+        printed = true;
+    }
+
+    size_t dropped = logDropped.exchange(0);
+    if (dropped > 0) std::clog << std::endl << "WARNING: \t" << dropped << " log message(s) dropped";
+
+    return printed;
+}
+
+
+void Log::startAsync() {
+    if (logRunning) return;
+
+    for (size_t i = 0; i < LOG_SLOTS; ++i) {
+        logSlots[i].sequence.store(i + logHead, std::memory_order_relaxed);
+    }
+    logTail = logHead;
+
+    logRunning = true;
+    logThread = std::thread([] {
+        while (logRunning) {
+            if (!drainMessages()) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    logAsync = true;
+}
+
+void Log::stopAsync() {
+    if (!logRunning) return;
+
+    logAsync = false;
+    logRunning = false;
+    logThread.join();
+
+    drainMessages();
+}
+
+
 Log::Log() {}
 
 
@@ -39,10 +158,12 @@ void Log::setReportingLevel(LoggingLevel level) {
 
 Log::~Log() {
     if (messageLevel >= Log::reportingLevel) {
-        if (messageLevel >= LoggingLevel::WARNING) {
-            std::clog << this->os.str();
+        std::string message = this->os.str();
+
+        if (logAsync) {
+            if (!pushMessage(messageLevel, message)) logDropped++;
         } else {
-            std::cout << this->os.str();
+            printMessage(messageLevel, message.data(), message.size());
         }
     }
 }
@@ -34,7 +34,31 @@ public:
     std::ostringstream& get(LoggingLevel level);
 
     static void setReportingLevel(LoggingLevel level);
+
+    /// Check if messages of a level are printed
+    static bool isReported(LoggingLevel level) { return level >= reportingLevel; }
+
+    /// Hand messages to a background thread instead of printing them on the logging thread.
+    ///
+    /// Messages are copied into a fixed ring buffer without taking any locks. Messages that don't fit,
+    /// because the buffer is full or they are too long, are dropped or cut short.
+    static void startAsync();
+
+    /// Print every message that is still waiting and stop the background thread
+    static void stopAsync();
+};
+
+
+/// Turns a logged message into void, so that both sides of the conditional in LOG have the same type
+struct LogVoidify {
+    void operator&(std::ostream&) {}
 };
 
 
+/// Log a message only if its level is printed, nothing is formatted otherwise:
+///
+///     LOG(INFO) << "Loaded " << count << " model(s)";
+#define LOG(level) !Log::isReported(level) ? (void) 0 : LogVoidify() & Log().get(level)
+
+
 
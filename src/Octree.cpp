@@ -3,45 +3,653 @@
 //
 
 #include "Octree.h"
+#include "Trace.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+
+
+/// Distances are only computed for levels with at most this many nodes along each axis
+const int MAX_DISTANCE_GRID = 128;
+
+/// Changed ranges closer than this are merged into one, to reduce the number of uploads
+const uint RANGE_MERGE_GAP = 16;
+
+Octree::Octree(uchar size, uchar brickLevel) : brickLevel(brickLevel), cleanNodes(0), cleanBricks(0) {
+    if (brickLevel != 0 && (brickLevel < 2 || brickLevel > 3)) {
+        throw std::runtime_error("Bricks must be either 4^3 or 8^3 voxels");
+    }
+
+    if (size <= brickLevel) {
+        throw std::runtime_error("The octree must be larger than its bricks");
+    }
 
-Octree::Octree(uchar size) {
     nodes.emplace_back(size);
 }
 
-void Octree::insert(int x, int y, int z, uint color) {
+Octree::Octree(std::vector<Node> nodes, std::vector<uint> bricks, uchar brickLevel) :
+        nodes(std::move(nodes)), bricks(std::move(bricks)), brickLevel(brickLevel), cleanNodes(0), cleanBricks(0) {
+    if (brickLevel != 0 && (brickLevel < 2 || brickLevel > 3)) {
+        throw std::runtime_error("Bricks must be either 4^3 or 8^3 voxels");
+    }
+
+    if (this->nodes.empty() || this->nodes[0].size <= brickLevel) {
+        throw std::runtime_error("The octree must be larger than its bricks");
+    }
+}
+
+void Octree::setVoxel(int x, int y, int z, uchar index) {
+    if (index == 0) {
+        this->clearVoxel(x, y, z);
+        return;
+    }
+
     this->resizeToFit(x, y, z);
 
     // Create nodes until the right position is found
     uchar size = nodes[0].size;
-    Node* currentNode = &nodes[0];
+    uint current = 0;
+
+    while (size > brickLevel) {
+        // Collapsed regions have to be split before a single voxel in them can change
+        if (nodes[current].flags & NODE_LEAF) {
+            if (nodes[current].children[0] == index) return;
+            this->splitLeaf(current);
+        }
 
-    while (size > 0) {
         uchar childIndex = 0b111;
 
         if (x < 0) childIndex ^= 0b100;
         if (y < 0) childIndex ^= 0b010;
         if (z < 0) childIndex ^= 0b001;
 
-        int childGlobalIndex = currentNode->children[childIndex];
+        uint childGlobalIndex = nodes[current].children[childIndex];
 
         if (childGlobalIndex == 0) {
-            auto newIndex = static_cast<uint>(this->nodes.size());
-            currentNode->children[childIndex] = newIndex;
-            this->nodes.emplace_back(size - 1);
-            childGlobalIndex = newIndex;
+            childGlobalIndex = this->createNode(size - 1);
+
+            if (brickLevel > 0 && size - 1 == brickLevel) {
+                uint brick = this->createBrick();
+                this->nodes[childGlobalIndex].flags |= NODE_BRICK;
+                this->nodes[childGlobalIndex].children[0] = brick;
+            } else if (size - 1 == 0) {
+                this->nodes[childGlobalIndex].flags |= NODE_LEAF;
+            }
+
+            nodes[current].children[childIndex] = childGlobalIndex;
+            nodes[current].mask |= 1u << childIndex;
+            this->touchNode(current);
         }
 
-        currentNode = &this->nodes[childGlobalIndex];
+        current = childGlobalIndex;
+
+        size -= 1;
+
+        if (size == 0) break;
+
+        uint realSize = 1u << (size - 1);
+        x += (x < 0 ? realSize : -realSize);
+        y += (y < 0 ? realSize : -realSize);
+        z += (z < 0 ? realSize : -realSize);
+    }
+
+    if (brickLevel == 0) {
+        nodes[current].children[0] = index;
+        this->touchNode(current);
+        return;
+    }
+
+    if (nodes[current].flags & NODE_LEAF) {
+        if (nodes[current].children[0] == index) return;
+        this->splitLeaf(current);
+    }
+
+    // Move the origin from the center of the brick to its corner
+    int half = 1 << (brickLevel - 1);
+    auto voxel = static_cast<uint>(((x + half) << (2 * brickLevel)) | ((y + half) << brickLevel) | (z + half));
+
+    uint offset = nodes[current].children[0];
+    uint* brick = &this->bricks[offset];
+    brick[voxel / 32] |= 1u << (voxel % 32);
+
+    uint* payload = brick + brickOccupancyWords(brickLevel);
+    payload[voxel / 4] &= ~(0xffu << (8 * (voxel % 4)));
+    payload[voxel / 4] |= uint(index) << (8 * (voxel % 4));
+
+    this->touchBrick(offset);
+}
+
+
+void Octree::clearVoxel(int x, int y, int z) {
+    uchar size = nodes[0].size;
+    auto halfSize = static_cast<int>(1u << (size - 1));
+
+    if (x < -halfSize || halfSize <= x || y < -halfSize || halfSize <= y || z < -halfSize || halfSize <= z) return;
+
+    // Remember the path from the root, so that nodes which become empty can be removed
+    uint path[32];
+    uchar pathChildren[32];
+    int depth = 0;
+
+    uint current = 0;
+
+    while (size > brickLevel) {
+        if (nodes[current].flags & NODE_LEAF) this->splitLeaf(current);
+
+        uchar childIndex = 0b111;
+
+        if (x < 0) childIndex ^= 0b100;
+        if (y < 0) childIndex ^= 0b010;
+        if (z < 0) childIndex ^= 0b001;
+
+        uint childGlobalIndex = nodes[current].children[childIndex];
+        if (childGlobalIndex == 0) return;
+
+        path[depth] = current;
+        pathChildren[depth] = childIndex;
+        depth++;
+
+        current = childGlobalIndex;
 
         size -= 1;
 
+        if (size == 0) break;
+
         uint realSize = 1u << (size - 1);
         x += (x < 0 ? realSize : -realSize);
         y += (y < 0 ? realSize : -realSize);
         z += (z < 0 ? realSize : -realSize);
     }
 
-    currentNode->children[0] = color;
+    if (brickLevel > 0) {
+        if (nodes[current].flags & NODE_LEAF) this->splitLeaf(current);
+
+        int half = 1 << (brickLevel - 1);
+        auto voxel = static_cast<uint>(((x + half) << (2 * brickLevel)) | ((y + half) << brickLevel) | (z + half));
+
+        uint offset = nodes[current].children[0];
+        uint* brick = &this->bricks[offset];
+        if (!(brick[voxel / 32] & (1u << (voxel % 32)))) return;
+
+        brick[voxel / 32] &= ~(1u << (voxel % 32));
+        this->touchBrick(offset);
+
+        for (uint i = 0; i < brickOccupancyWords(brickLevel); ++i) {
+            if (brick[i] != 0) return;
+        }
+
+        this->freeBricks.push_back(offset);
+    }
+
+    // Remove the empty node, and every parent which becomes empty as a result
+    this->freeNodes.push_back(current);
+
+    while (depth > 0) {
+        depth--;
+        uint parent = path[depth];
+
+        nodes[parent].children[pathChildren[depth]] = 0;
+        nodes[parent].mask &= ~(1u << pathChildren[depth]);
+        this->touchNode(parent);
+
+        if (nodes[parent].mask != 0 || parent == 0) break;
+
+        this->freeNodes.push_back(parent);
+    }
+}
+
+
+void Octree::fillBox(int minX, int minY, int minZ, int maxX, int maxY, int maxZ, uchar index) {
+    for (int x = minX; x <= maxX; ++x) {
+        for (int y = minY; y <= maxY; ++y) {
+            for (int z = minZ; z <= maxZ; ++z) {
+                this->setVoxel(x, y, z, index);
+            }
+        }
+    }
+}
+
+
+void Octree::merge(const Octree& other) {
+    if (other.brickLevel != this->brickLevel) {
+        throw std::runtime_error("Only octrees with the same brick size can be merged");
+    }
+
+    // Copying the other octree never needs more than what it uses
+    this->reserveElements(other.nodes.size(), other.bricks.size());
+
+    // Both roots are centered on the origin, so once this one is at least as large the other lines up with it
+    uchar otherSize = other.nodes[0].size;
+    int half = 1 << (otherSize - 1);
+    this->resizeToFit(-half, -half, -half);
+
+    for (uchar i = 0; i < 8; ++i) {
+        uint source = other.nodes[0].children[i];
+        if (source == 0) continue;
+
+        // Find the node covering the same region as the other root's child: it lies in the
+        // same octant as the child, and then always in the corner closest to the origin
+        uint current = 0;
+        uchar childIndex = i;
+
+        for (uchar size = nodes[0].size; size > otherSize; size--) {
+            // Collapsed regions have to be split before the other octree can be merged into them
+            if (nodes[current].flags & NODE_LEAF) this->splitLeaf(current);
+
+            uint next = nodes[current].children[childIndex];
+
+            if (next == 0) {
+                next = this->createNode(static_cast<uchar>(size - 1));
+                nodes[current].children[childIndex] = next;
+                nodes[current].mask |= 1u << childIndex;
+                this->touchNode(current);
+            }
+
+            current = next;
+            childIndex = static_cast<uchar>(7 - i);
+        }
+
+        if (nodes[current].flags & NODE_LEAF) this->splitLeaf(current);
+
+        uint target = nodes[current].children[childIndex];
+
+        if (target == 0) {
+            uint copy = this->copySubtree(other, source);
+            nodes[current].children[childIndex] = copy;
+            nodes[current].mask |= 1u << childIndex;
+            this->touchNode(current);
+        } else {
+            this->mergeSubtree(target, other, source);
+        }
+    }
+}
+
+
+uint Octree::copySubtree(const Octree& other, uint source) {
+    const Node& node = other.nodes[source];
+    uint index = this->createNode(node.size);
+    nodes[index].flags = node.flags;
+
+    if (node.flags & NODE_BRICK) {
+        uint brick = this->createBrick();
+        const uint* words = &other.bricks[node.children[0]];
+        std::copy(words, words + brickWords(brickLevel), this->bricks.begin() + brick);
+
+        nodes[index].children[0] = brick;
+    } else if (node.flags & NODE_LEAF) {
+        nodes[index].children[0] = node.children[0];
+    } else {
+        for (int i = 0; i < 8; ++i) {
+            if (node.children[i] == 0) continue;
+
+            // Copying may reallocate the nodes, so the index is used instead of a reference
+            uint child = this->copySubtree(other, node.children[i]);
+            nodes[index].children[i] = child;
+            nodes[index].mask |= 1u << i;
+        }
+    }
+
+    this->touchNode(index);
+    return index;
+}
+
+
+void Octree::mergeSubtree(uint target, const Octree& other, uint source) {
+    const Node& node = other.nodes[source];
+
+    // A uniform region replaces everything it covers
+    if (node.flags & NODE_LEAF) {
+        this->releaseChildren(target);
+
+        nodes[target].flags = NODE_LEAF;
+        nodes[target].mask = 0;
+        std::fill(nodes[target].children, nodes[target].children + 8, 0);
+        nodes[target].children[0] = node.children[0];
+
+        this->touchNode(target);
+        return;
+    }
+
+    if (nodes[target].flags & NODE_LEAF) this->splitLeaf(target);
+
+    if (node.flags & NODE_BRICK) {
+        uint offset = nodes[target].children[0];
+        uint* brick = &this->bricks[offset];
+        const uint* otherBrick = &other.bricks[node.children[0]];
+
+        uint occupancyWords = brickOccupancyWords(brickLevel);
+        uint* payload = brick + occupancyWords;
+        const uint* otherPayload = otherBrick + occupancyWords;
+
+        for (uint voxel = 0; voxel < 32 * occupancyWords; ++voxel) {
+            if (!(otherBrick[voxel / 32] & (1u << (voxel % 32)))) continue;
+
+            uint byte = 0xffu << (8 * (voxel % 4));
+            brick[voxel / 32] |= 1u << (voxel % 32);
+            payload[voxel / 4] = (payload[voxel / 4] & ~byte) | (otherPayload[voxel / 4] & byte);
+        }
+
+        this->touchBrick(offset);
+        return;
+    }
+
+    for (int i = 0; i < 8; ++i) {
+        if (node.children[i] == 0) continue;
+
+        uint child = nodes[target].children[i];
+
+        if (child == 0) {
+            child = this->copySubtree(other, node.children[i]);
+            nodes[target].children[i] = child;
+            nodes[target].mask |= 1u << i;
+            this->touchNode(target);
+        } else {
+            this->mergeSubtree(child, other, node.children[i]);
+        }
+    }
+}
+
+
+void Octree::splitLeaf(uint index) {
+    uchar size = nodes[index].size;
+    uint paletteIndex = nodes[index].children[0];
+
+    if (size == brickLevel) {
+        uint brick = this->createBrick();
+        uint occupancyWords = brickOccupancyWords(brickLevel);
+
+        std::fill(this->bricks.begin() + brick, this->bricks.begin() + brick + occupancyWords, 0xffffffffu);
+        std::fill(this->bricks.begin() + brick + occupancyWords, this->bricks.begin() + brick + brickWords(brickLevel),
+                  paletteIndex * 0x01010101u);
+
+        nodes[index].flags = NODE_BRICK;
+        nodes[index].children[0] = brick;
+        this->touchNode(index);
+        return;
+    }
+
+    nodes[index].flags = 0;
+    nodes[index].children[0] = 0;
+
+    for (int i = 0; i < 8; ++i) {
+        uint child = this->createNode(static_cast<uchar>(size - 1));
+        nodes[child].flags = NODE_LEAF;
+        nodes[child].children[0] = paletteIndex;
+
+        nodes[index].children[i] = child;
+    }
+
+    nodes[index].mask = 0xff;
+    this->touchNode(index);
+}
+
+
+void Octree::releaseChildren(uint index) {
+    const Node& node = nodes[index];
+
+    if (node.flags & NODE_BRICK) {
+        this->freeBricks.push_back(node.children[0]);
+        return;
+    }
+
+    if (node.flags & NODE_LEAF) return;
+
+    for (uint child : node.children) {
+        if (child == 0) continue;
+
+        this->releaseChildren(child);
+        this->freeNodes.push_back(child);
+    }
+}
+
+
+void Octree::collapse() {
+    TraceSpan span("collapse");
+
+    // The root stays a regular node, so that it can grow
+    for (uint child : nodes[0].children) {
+        uint paletteIndex;
+        if (child != 0) this->collapseNode(child, &paletteIndex);
+    }
+
+    std::vector<Node> compactNodes;
+    std::vector<uint> compactBricks;
+    compactNodes.reserve(this->nodes.size() - this->freeNodes.size());
+    compactBricks.reserve(this->bricks.size() - this->freeBricks.size() * brickWords(brickLevel));
+
+    this->compactNode(0, compactNodes, compactBricks);
+
+    this->nodes.swap(compactNodes);
+    this->bricks.swap(compactBricks);
+
+    this->freeNodes.clear();
+    this->freeBricks.clear();
+
+    // Everything has moved
+    this->cleanNodes = 0;
+    this->cleanBricks = 0;
+    this->changedNodes.clear();
+    this->changedBricks.clear();
+}
+
+
+bool Octree::collapseNode(uint index, uint* paletteIndex) {
+    Node& node = nodes[index];
+
+    if (node.flags & NODE_LEAF) {
+        *paletteIndex = node.children[0];
+        return true;
+    }
+
+    if (node.flags & NODE_BRICK) {
+        uint offset = node.children[0];
+        uint occupancyWords = brickOccupancyWords(brickLevel);
+
+        for (uint i = 0; i < occupancyWords; ++i) {
+            if (this->bricks[offset + i] != 0xffffffffu) return false;
+        }
+
+        uint payload = this->bricks[offset + occupancyWords];
+        if ((payload & 0xff) * 0x01010101u != payload) return false;
+
+        for (uint i = occupancyWords; i < brickWords(brickLevel); ++i) {
+            if (this->bricks[offset + i] != payload) return false;
+        }
+
+        this->freeBricks.push_back(offset);
+
+        node.flags = NODE_LEAF;
+        node.children[0] = payload & 0xff;
+        this->touchNode(index);
+
+        *paletteIndex = payload & 0xff;
+        return true;
+    }
+
+    // Every child has to be collapsed, even when this node cannot be
+    bool uniform = node.mask == 0xff;
+    uint common = 0;
+
+    for (int i = 0; i < 8; ++i) {
+        uint childIndex;
+        if (node.children[i] == 0 || !this->collapseNode(node.children[i], &childIndex)) {
+            uniform = false;
+            continue;
+        }
+
+        if (i > 0 && childIndex != common) uniform = false;
+        common = childIndex;
+    }
+
+    if (!uniform) return false;
+
+    for (uint& child : node.children) {
+        this->freeNodes.push_back(child);
+        child = 0;
+    }
+
+    node.flags = NODE_LEAF;
+    node.mask = 0;
+    node.children[0] = common;
+    this->touchNode(index);
+
+    *paletteIndex = common;
+    return true;
+}
+
+
+uint Octree::compactNode(uint index, std::vector<Node>& compactNodes, std::vector<uint>& compactBricks) const {
+    auto compactIndex = static_cast<uint>(compactNodes.size());
+    compactNodes.push_back(nodes[index]);
+
+    const Node& node = nodes[index];
+
+    if (node.flags & NODE_BRICK) {
+        auto offset = static_cast<uint>(compactBricks.size());
+        const uint* words = &this->bricks[node.children[0]];
+        compactBricks.insert(compactBricks.end(), words, words + brickWords(brickLevel));
+
+        compactNodes[compactIndex].children[0] = offset;
+    } else if (!(node.flags & NODE_LEAF)) {
+        for (int i = 0; i < 8; ++i) {
+            if (node.children[i] == 0) continue;
+
+            uint child = this->compactNode(node.children[i], compactNodes, compactBricks);
+            compactNodes[compactIndex].children[i] = child;
+        }
+    }
+
+    return compactIndex;
+}
+
+
+void Octree::relayout(NodeOrder order) {
+    TraceSpan span("relayout");
+
+    // The old indices of the nodes in their new order
+    std::vector<uint> sequence;
+    sequence.reserve(this->nodes.size() - this->freeNodes.size());
+
+    switch (order) {
+        case DEPTH_FIRST_ORDER:
+            this->appendDepthFirst(0, sequence);
+            break;
+
+        case BREADTH_FIRST_ORDER:
+            sequence.push_back(0);
+            for (size_t i = 0; i < sequence.size(); ++i) {
+                this->appendChildren(sequence[i], sequence);
+            }
+            break;
+
+        case SIBLING_ORDER:
+            sequence.push_back(0);
+            this->appendSiblings(0, sequence);
+            break;
+
+        case VAN_EMDE_BOAS_ORDER:
+            // Bricks, or single voxels, are the deepest nodes
+            this->appendVanEmdeBoas(0, nodes[0].size - brickLevel + 1u, sequence);
+            break;
+    }
+
+    // Removed nodes are moved to the end, where they are cut off
+    auto nodeCount = static_cast<uint>(sequence.size());
+    std::vector<uint> newIndices(this->nodes.size(), nodeCount);
+    for (uint i = 0; i < nodeCount; ++i) {
+        newIndices[sequence[i]] = i;
+    }
+
+    std::vector<uint>().swap(sequence);
+
+    uint removed = nodeCount;
+    for (uint& newIndex : newIndices) {
+        if (newIndex == nodeCount) newIndex = removed++;
+    }
+
+    for (uint i = 0; i < this->nodes.size(); ++i) {
+        Node& node = this->nodes[i];
+        if (newIndices[i] >= nodeCount || (node.flags & (NODE_BRICK | NODE_LEAF))) continue;
+
+        for (uint& child : node.children) {
+            if (child != 0) child = newIndices[child];
+        }
+    }
+
+    // Permute the nodes in place, so that the node buffer never exists twice
+    for (uint i = 0; i < newIndices.size(); ++i) {
+        while (newIndices[i] != i) {
+            uint target = newIndices[i];
+            std::swap(this->nodes[i], this->nodes[target]);
+            std::swap(newIndices[i], newIndices[target]);
+        }
+    }
+
+    this->nodes.erase(this->nodes.begin() + nodeCount, this->nodes.end());
+    this->freeNodes.clear();
+
+    // Every node has moved
+    this->cleanNodes = 0;
+    this->changedNodes.clear();
+}
+
+
+void Octree::appendChildren(uint index, std::vector<uint>& sequence) const {
+    const Node& node = nodes[index];
+    if (node.flags & (NODE_BRICK | NODE_LEAF)) return;
+
+    for (uint child : node.children) {
+        if (child != 0) sequence.push_back(child);
+    }
+}
+
+
+void Octree::appendDepthFirst(uint index, std::vector<uint>& sequence) const {
+    sequence.push_back(index);
+
+    const Node& node = nodes[index];
+    if (node.flags & (NODE_BRICK | NODE_LEAF)) return;
+
+    for (uint child : node.children) {
+        if (child != 0) this->appendDepthFirst(child, sequence);
+    }
+}
+
+
+void Octree::appendSiblings(uint index, std::vector<uint>& sequence) const {
+    size_t first = sequence.size();
+    this->appendChildren(index, sequence);
+    size_t last = sequence.size();
+
+    for (size_t i = first; i < last; ++i) {
+        this->appendSiblings(sequence[i], sequence);
+    }
+}
+
+
+void Octree::appendVanEmdeBoas(uint index, uint levels, std::vector<uint>& sequence) const {
+    const Node& node = nodes[index];
+
+    if (levels <= 1 || (node.flags & (NODE_BRICK | NODE_LEAF))) {
+        sequence.push_back(index);
+        return;
+    }
+
+    uint topLevels = levels / 2;
+    this->appendVanEmdeBoas(index, topLevels, sequence);
+
+    // The roots of the bottom trees are the nodes right below the top tree
+    std::vector<uint> roots = {index};
+    for (uint level = 0; level < topLevels; ++level) {
+        std::vector<uint> below;
+        for (uint root : roots) this->appendChildren(root, below);
+        roots.swap(below);
+    }
+
+    for (uint root : roots) {
+        this->appendVanEmdeBoas(root, levels - topLevels, sequence);
+    }
 }
 
 
@@ -86,20 +694,322 @@ void Octree::resizeToFit(int x, int y, int z) {
             uint globalChildIndex = nodes[0].children[i];
 
             if (globalChildIndex != 0) {
-                Node node = Node(size);
-
-                node.children[7 - i] = globalChildIndex;
-                nodes[0].children[i] = static_cast<uint>(nodes.size());
+                uint newIndex = this->createNode(nodes[0].size);
 
-                nodes.push_back(node);
+                nodes[newIndex].children[7 - i] = globalChildIndex;
+                nodes[newIndex].mask = static_cast<uchar>(1u << (7 - i));
+                nodes[0].children[i] = newIndex;
             }
         }
 
         nodes[0].size++;
         halfSize *= 2;
+
+        this->touchNode(0);
     }
 }
 
-std::vector<Node> Octree::getNodes() {
+const std::vector<Node>& Octree::getNodes() const {
     return this->nodes;
 }
+
+const std::vector<uint>& Octree::getBricks() const {
+    return this->bricks;
+}
+
+const Node* Octree::getNodeData() const {
+    return this->nodes.data();
+}
+
+size_t Octree::getNodeCount() const {
+    return this->nodes.size();
+}
+
+const uint* Octree::getBrickData() const {
+    return this->bricks.data();
+}
+
+size_t Octree::getBrickWordCount() const {
+    return this->bricks.size();
+}
+
+uchar Octree::getBrickLevel() const {
+    return this->brickLevel;
+}
+
+
+/// Grow the bounds to include every leaf and brick below a node, whose minimum corner is at (x, y, z)
+static void occupiedBounds(const Node* nodes, uint index, int x, int y, int z, int min[3], int max[3]) {
+    const Node& node = nodes[index];
+    int size = 1 << node.size;
+
+    if (node.flags & (NODE_BRICK | NODE_LEAF)) {
+        int corner[3] = {x, y, z};
+
+        for (int i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], corner[i]);
+            max[i] = std::max(max[i], corner[i] + size);
+        }
+
+        return;
+    }
+
+    int half = size / 2;
+    for (int i = 0; i < 8; ++i) {
+        if (node.children[i] == 0) continue;
+
+        occupiedBounds(nodes, node.children[i],
+                       x + ((i & 0b100) ? half : 0),
+                       y + ((i & 0b010) ? half : 0),
+                       z + ((i & 0b001) ? half : 0),
+                       min, max);
+    }
+}
+
+void Octree::growOccupiedBounds(int min[3], int max[3]) const {
+    int half = 1 << (this->nodes[0].size - 1);
+    occupiedBounds(this->nodes.data(), 0, -half, -half, -half, min, max);
+}
+
+
+/// Sort changed elements into ranges, including everything from `clean` to `size`.
+/// Each changed element spans `extent` items starting at its index.
+static std::vector<Range> collectRanges(std::vector<uint>& changed, uint extent, uint clean, uint size) {
+    std::sort(changed.begin(), changed.end());
+    changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+    if (clean < size) changed.push_back(clean);
+
+    std::vector<Range> ranges;
+    for (uint first : changed) {
+        uint end = first == clean ? size : first + extent;
+
+        // Merge ranges that are close enough to be uploaded together
+        if (!ranges.empty() && first <= ranges.back().first + ranges.back().count + RANGE_MERGE_GAP) {
+            Range& last = ranges.back();
+            last.count = std::max(last.count, end - last.first);
+        } else {
+            ranges.push_back({first, end - first});
+        }
+    }
+
+    changed.clear();
+    return ranges;
+}
+
+std::vector<Range> Octree::takeChangedNodes() {
+    auto size = static_cast<uint>(this->nodes.size());
+    std::vector<Range> ranges = collectRanges(this->changedNodes, 1, this->cleanNodes, size);
+    this->cleanNodes = size;
+    return ranges;
+}
+
+std::vector<Range> Octree::takeChangedBricks() {
+    auto size = static_cast<uint>(this->bricks.size());
+    std::vector<Range> ranges = collectRanges(this->changedBricks, brickWords(brickLevel), this->cleanBricks, size);
+    this->cleanBricks = size;
+    return ranges;
+}
+
+
+void Octree::reserve(size_t voxelCount, int extent) {
+    size_t nodeCount = 0;
+    size_t brickCount = 0;
+
+    // A surface covers about 4^level voxels in every cell it passes through, and every
+    // level can have no more cells than fit in the box
+    for (uchar level = brickLevel; level < 32 && (extent >> level) > 0; ++level) {
+        size_t side = (static_cast<size_t>(extent) >> level) + 2;
+        size_t cells = std::min(side * side * side, (voxelCount >> (2 * level)) + 1);
+
+        if (level == brickLevel && brickLevel != 0) brickCount = cells;
+        nodeCount += cells;
+    }
+
+    this->reserveElements(nodeCount, brickCount * brickWords(brickLevel));
+}
+
+void Octree::reserveElements(size_t nodeCount, size_t brickWordCount) {
+    if (this->nodes.size() + nodeCount > this->nodes.capacity()) {
+        this->nodes.reserve(std::max(this->nodes.size() + nodeCount, 2 * this->nodes.capacity()));
+    }
+
+    if (this->bricks.size() + brickWordCount > this->bricks.capacity()) {
+        this->bricks.reserve(std::max(this->bricks.size() + brickWordCount, 2 * this->bricks.capacity()));
+    }
+}
+
+uint Octree::createNode(uchar size) {
+    if (!this->freeNodes.empty()) {
+        uint index = this->freeNodes.back();
+        this->freeNodes.pop_back();
+
+        this->nodes[index] = Node(size);
+        this->touchNode(index);
+        return index;
+    }
+
+    auto index = static_cast<uint>(this->nodes.size());
+    this->nodes.emplace_back(size);
+    return index;
+}
+
+uint Octree::createBrick() {
+    uint words = brickWords(brickLevel);
+
+    if (!this->freeBricks.empty()) {
+        uint offset = this->freeBricks.back();
+        this->freeBricks.pop_back();
+
+        std::fill(this->bricks.begin() + offset, this->bricks.begin() + offset + words, 0);
+        this->touchBrick(offset);
+        return offset;
+    }
+
+    auto offset = static_cast<uint>(this->bricks.size());
+    this->bricks.resize(offset + words, 0);
+    return offset;
+}
+
+void Octree::touchNode(uint index) {
+    if (index < this->cleanNodes) this->changedNodes.push_back(index);
+}
+
+void Octree::touchBrick(uint offset) {
+    if (offset < this->cleanBricks) this->changedBricks.push_back(offset);
+}
+
+
+/// Replace every empty cell (255) in a grid with the Chebyshev distance to the closest occupied cell (0).
+///
+/// Uses a two-pass chamfer transform: the first pass propagates distances from the 13 neighbours which
+/// precede a cell in memory, the second pass from the 13 neighbours which follow it.
+static void chebyshevDistanceTransform(std::vector<uchar>& grid, int dim) {
+    for (int pass = 0; pass < 2; ++pass) {
+        int step = pass == 0 ? 1 : -1;
+        int first = pass == 0 ? 0 : dim - 1;
+
+        for (int x = first; 0 <= x && x < dim; x += step) {
+            for (int y = first; 0 <= y && y < dim; y += step) {
+                for (int z = first; 0 <= z && z < dim; z += step) {
+                    uchar& cell = grid[(x * dim + y) * dim + z];
+
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        for (int dy = -1; dy <= 1; ++dy) {
+                            for (int dz = -1; dz <= 1; ++dz) {
+                                // Only look at neighbours that have already been visited in this pass
+                                int offset = (dx * dim + dy) * dim + dz;
+                                if (offset * step >= 0) continue;
+
+                                int nx = x + dx, ny = y + dy, nz = z + dz;
+                                if (nx < 0 || ny < 0 || nz < 0 || nx >= dim || ny >= dim || nz >= dim) continue;
+
+                                uchar neighbour = grid[(nx * dim + ny) * dim + nz];
+                                if (neighbour < 255 && neighbour + 1 < cell) {
+                                    cell = static_cast<uchar>(neighbour + 1);
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+
+std::vector<uchar> computeEmptyDistances(const std::vector<Node>& nodes, uchar* unitLevel) {
+    TraceSpan span("computeEmptyDistances");
+
+    std::vector<uchar> distances(nodes.size() * 8, 255);
+    uchar rootSize = nodes[0].size;
+
+    // Use the finest grid that does not exceed the maximum size
+    int level = 0;
+    while ((1 << (rootSize - level)) > MAX_DISTANCE_GRID) level++;
+
+    int dim = 1 << (rootSize - level);
+    std::vector<uchar> grid(static_cast<size_t>(dim) * dim * dim, 255);
+    *unitLevel = static_cast<uchar>(level);
+
+    // A node's position and logarithmic size, with the position measured in its own size
+    struct Cell {
+        uint node;
+        int child, size, x, y, z;
+    };
+
+    // Mark all cells covered by a region as occupied
+    auto fill = [&](int size, int x, int y, int z) {
+        int extent = 1 << (size - level);
+        for (int i = x * extent; i < (x + 1) * extent; ++i) {
+            for (int j = y * extent; j < (y + 1) * extent; ++j) {
+                for (int k = z * extent; k < (z + 1) * extent; ++k) {
+                    grid[(i * dim + j) * dim + k] = 0;
+                }
+            }
+        }
+    };
+
+    std::vector<Cell> empty;
+
+    // Nodes smaller than a cell are never visited, and have unknown distances
+    std::vector<bool> visited(nodes.size(), false);
+
+    // Visit every node down to the size of a cell and find the occupied cells
+    std::vector<Cell> stack = {{0, 0, rootSize, 0, 0, 0}};
+    while (!stack.empty()) {
+        Cell cell = stack.back();
+        stack.pop_back();
+
+        const Node& node = nodes[cell.node];
+        int size = cell.size - 1;
+        visited[cell.node] = true;
+
+        for (int i = 0; i < 8; ++i) {
+            int x = 2 * cell.x + ((i >> 2) & 1);
+            int y = 2 * cell.y + ((i >> 1) & 1);
+            int z = 2 * cell.z + (i & 1);
+
+            if (!(node.mask & (1u << i))) {
+                empty.push_back({cell.node, i, size, x, y, z});
+                continue;
+            }
+
+            uint childIndex = node.children[i];
+            const Node& child = nodes[childIndex];
+
+            if (size > level && !(child.flags & (NODE_BRICK | NODE_LEAF))) {
+                stack.push_back({childIndex, 0, size, x, y, z});
+            } else {
+                // Bricks are treated as if they were full
+                fill(size, x, y, z);
+            }
+        }
+    }
+
+    chebyshevDistanceTransform(grid, dim);
+
+    for (const Cell& cell : empty) {
+        // The closest occupied cell from any of the cells covered by the child
+        int extent = 1 << (cell.size - level);
+        uchar closest = 255;
+
+        for (int i = cell.x * extent; i < (cell.x + 1) * extent; ++i) {
+            for (int j = cell.y * extent; j < (cell.y + 1) * extent; ++j) {
+                for (int k = cell.z * extent; k < (cell.z + 1) * extent; ++k) {
+                    closest = std::min(closest, grid[(i * dim + j) * dim + k]);
+                }
+            }
+        }
+
+        // A node may be reached from several parents, so only keep the most conservative distance
+        uchar& distance = distances[8 * cell.node + cell.child];
+        distance = std::min(distance, static_cast<uchar>(closest > 0 ? closest - 1 : 0));
+    }
+
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        if (!visited[i]) std::fill(distances.begin() + 8 * i, distances.begin() + 8 * (i + 1), 0);
+    }
+
+    return distances;
+}
@@ -6,43 +6,205 @@
 
 
 #include <vector>
+#include <cstddef>
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
 
+
+/// The node's first child is an offset into the brick buffer instead of a node index
+const uchar NODE_BRICK = 0b0001;
+
+/// The node is completely filled with the palette index in its first child, regardless of its size
+const uchar NODE_LEAF = 0b0010;
+
+/// The node stands in for a page of a streamed octree that is not on the device, with the page's index in its first child
+const uchar NODE_PAGE = 0b0100;
+
+
 struct Node {
     // The logarithmic size of this node
     uchar size;
 
+    // Describes how the children of this node should be interpreted
+    uchar flags;
+
+    // Bit i is set if child i is not empty
+    uchar mask;
+
     // The indices of this node's children.
     // If the index is 0 the child is empty
     uint children[8];
 
 
     explicit Node(uchar size, std::vector<uint> children = {0, 0, 0, 0, 0, 0, 0, 0}) :
-            size(size), children{0} {
+            size(size), flags(0), mask(0), children{0} {
         for (int i = 0; i < 8; ++i) {
             this->children[i] = children[i];
+            if (children[i] != 0) this->mask |= 1u << i;
         }
     }
 };
 
 
+/// The number of uints needed to store a brick with the logarithmic size `level`.
+///
+/// A brick is a dense grid of voxels, stored as an occupancy bitmask (one bit per voxel)
+/// followed by the palette indices of every voxel (one byte per voxel).
+/// Voxels are numbered as `(x * dim + y) * dim + z`, where `dim = 1 << level`.
+inline uint brickOccupancyWords(uchar level) { return 1u << (3 * level - 5); }
+inline uint brickWords(uchar level) { return brickOccupancyWords(level) + (1u << (3 * level - 2)); }
+
+
+/// Orders in which the nodes of an octree can be placed in memory
+enum NodeOrder {
+    /// Every node is directly followed by the subtrees of its children
+    DEPTH_FIRST_ORDER,
+
+    /// Nodes are stored level by level, starting at the root
+    BREADTH_FIRST_ORDER,
+
+    /// The children of a node are stored next to each other, followed by the subtree of each child in turn
+    SIBLING_ORDER,
+
+    /// The tree is cut at half its height, the top half is stored first and then every bottom tree,
+    /// each of them laid out the same way. Nodes close in the tree end up close in memory at every scale.
+    VAN_EMDE_BOAS_ORDER
+};
+
+
+/// A range of elements in a buffer
+struct Range {
+    uint first, count;
+};
+
+
 class Octree {
 
     std::vector<Node> nodes;
 
+    /// Dense bricks referenced by the nodes at `brickLevel`
+    std::vector<uint> bricks;
+
+    /// The logarithmic size of the bricks, or 0 if every voxel is stored as a node
+    uchar brickLevel;
+
+    /// Nodes and bricks that have been removed and may be reused
+    std::vector<uint> freeNodes, freeBricks;
+
+    /// Everything below these have been handed out as changes,
+    /// later modifications to them are recorded so that they can be uploaded again
+    uint cleanNodes, cleanBricks;
+    std::vector<uint> changedNodes, changedBricks;
+
 public:
 
-    explicit Octree(uchar size);
+    explicit Octree(uchar size, uchar brickLevel = 0);
+
+    /// Take over the nodes and bricks of an octree, such as those read from a file
+    Octree(std::vector<Node> nodes, std::vector<uint> bricks, uchar brickLevel);
+
+    /// Set a voxel to a palette index, the index 0 removes the voxel
+    void setVoxel(int x, int y, int z, uchar index);
+
+    /// Make room for `voxelCount` more voxels within a box with sides of `extent` voxels,
+    /// so that the node and brick buffers don't have to grow one step at a time while they are inserted.
+    ///
+    /// Voxels are assumed to mostly form surfaces, scattered voxels may need more room.
+    void reserve(size_t voxelCount, int extent);
 
-    void insert(int x, int y, int z, uint color);
+    /// Remove a voxel, and every node that becomes empty
+    void clearVoxel(int x, int y, int z);
 
-    std::vector<Node> getNodes();
+    /// Set every voxel within the box [min, max] to a palette index
+    void fillBox(int minX, int minY, int minZ, int maxX, int maxY, int maxZ, uchar index);
+
+    /// Add every voxel of another octree to this one, overwriting voxels that are in both.
+    /// Both octrees must use the same brick size.
+    void merge(const Octree& other);
+
+    /// Replace every region filled with a single palette index by a leaf, and remove unused nodes and bricks.
+    ///
+    /// Nodes and bricks are renumbered, so everything is reported as changed afterwards.
+    /// Editing a voxel inside a collapsed region splits it up again.
+    void collapse();
+
+    /// Renumber the nodes in a certain order, the root stays at index 0 and the bricks are left where they are.
+    ///
+    /// Removed nodes are dropped, and everything is reported as changed afterwards.
+    void relayout(NodeOrder order);
+
+    /// The nodes and bricks as they are stored, without copying them
+    const std::vector<Node>& getNodes() const;
+    const std::vector<uint>& getBricks() const;
+
+    const Node* getNodeData() const;
+    size_t getNodeCount() const;
+
+    const uint* getBrickData() const;
+    size_t getBrickWordCount() const;
+
+    uchar getBrickLevel() const;
+
+    /// Grow the bounds [min, max) to include every leaf and brick, bricks are included as a whole
+    void growOccupiedBounds(int min[3], int max[3]) const;
+
+    /// Get the ranges of nodes that have changed, or been added, since the last call
+    std::vector<Range> takeChangedNodes();
+
+    /// Get the ranges of the brick buffer that have changed, or been added, since the last call
+    std::vector<Range> takeChangedBricks();
 
 private:
     void resizeToFit(int x, int y, int z);
-};
 
+    /// Copy a node of another octree, and everything below it, into this one and return its index
+    uint copySubtree(const Octree& other, uint source);
+
+    /// Merge a node of another octree into a node of the same size in this one
+    void mergeSubtree(uint target, const Octree& other, uint source);
+
+    /// Turn a leaf into a node with eight leaf children, or into a full brick if it is as small as a brick
+    void splitLeaf(uint index);
+
+    /// Free everything below a node
+    void releaseChildren(uint index);
+
+    /// Collapse the uniform regions below a node, returns true with the node's palette index if it became a leaf
+    bool collapseNode(uint index, uint* paletteIndex);
+
+    /// Copy a node, and everything below it, to the end of new node and brick buffers and return its new index
+    uint compactNode(uint index, std::vector<Node>& compactNodes, std::vector<uint>& compactBricks) const;
+
+    /// Grow the node and brick buffers to fit more elements, at least doubling their capacity
+    void reserveElements(size_t nodeCount, size_t brickWordCount);
+
+    /// Append the indices of a node's children, if it has child nodes
+    void appendChildren(uint index, std::vector<uint>& sequence) const;
+
+    /// Append the nodes below a node in depth first order, with or without the node's children stored next to each other
+    void appendDepthFirst(uint index, std::vector<uint>& sequence) const;
+    void appendSiblings(uint index, std::vector<uint>& sequence) const;
+
+    /// Append the nodes of the `levels` topmost levels of a subtree in van Emde Boas order
+    void appendVanEmdeBoas(uint index, uint levels, std::vector<uint>& sequence) const;
+
+    /// Allocate an empty node and return its index
+    uint createNode(uchar size);
+
+    /// Allocate an empty brick and return its offset
+    uint createBrick();
+
+    /// Record a change to a node or brick
+    void touchNode(uint index);
+    void touchBrick(uint offset);
+};
 
 
+/// Compute how much empty space surrounds every empty child.
+///
+/// Occupancy is sampled on a grid of cells with the logarithmic size `unitLevel`, and for every empty child
+/// the Chebyshev distance to the closest occupied cell is measured. One byte is stored per child:
+/// `distances[8 * node + child]`, which tells how many cells beyond the child's bounds in every direction
+/// are known to be empty. Distances saturate at 255.
+std::vector<uchar> computeEmptyDistances(const std::vector<Node>& nodes, uchar* unitLevel);
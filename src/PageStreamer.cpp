@@ -0,0 +1,242 @@
+#include "PageStreamer.h"
+
+#include <stdexcept>
+#include <algorithm>
+
+
+/// Marks slots without a page, and pages without a slot
+const uint NO_SLOT = 0xffffffffu;
+
+
+PageStreamer::PageStreamer(const SvoFile& file, cl_context context, cl_command_queue queue, size_t memory) :
+        file(file), queue(queue), frame(1), stopping(false), reading(0) {
+    const SvoHeader& header = file.getHeader();
+
+    this->slotNodes = header.maxPageNodes;
+    this->slotBrickWords = header.maxPageBrickWords;
+
+    size_t slotBytes = this->slotNodes * sizeof(Node) + this->slotBrickWords * sizeof(uint);
+    this->slotCount = static_cast<uint>(std::min<size_t>(memory / slotBytes, header.pageCount));
+    if (this->slotCount == 0) throw std::runtime_error("Not enough memory for a single page");
+
+    cl_int error;
+    size_t nodeCount = header.topNodeCount + size_t(this->slotCount) * this->slotNodes;
+    this->nodes = clCreateBuffer(context, CL_MEM_READ_ONLY, nodeCount * sizeof(Node), nullptr, &error);
+    checkCLError(error);
+
+    error = clEnqueueWriteBuffer(queue, this->nodes, CL_TRUE, 0, header.topNodeCount * sizeof(Node), file.getTopNodes(), 0, nullptr, nullptr);
+    checkCLError(error);
+
+    // Octrees without bricks still need a buffer to bind
+    size_t brickWordCount = std::max<size_t>(1, size_t(this->slotCount) * this->slotBrickWords);
+    this->bricks = clCreateBuffer(context, CL_MEM_READ_ONLY, brickWordCount * sizeof(uint), nullptr, &error);
+    checkCLError(error);
+
+    std::vector<uint> feedbackWords(1 + MAX_PAGE_REQUESTS + header.pageCount + this->slotCount, 0);
+    this->feedback = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, feedbackWords.size() * sizeof(uint), feedbackWords.data(), &error);
+    checkCLError(error);
+
+    this->slotPages.assign(this->slotCount, NO_SLOT);
+    this->pageSlots.assign(header.pageCount, NO_SLOT);
+    this->slotUsage.assign(this->slotCount, 0);
+
+    for (uint slot = this->slotCount; slot > 0; --slot) {
+        this->freeSlots.push_back(slot - 1);
+    }
+
+    LOG(INFO) << "Streaming " << header.pageCount << " page(s) through " << this->slotCount << " slot(s) of "
+              << slotBytes << " bytes";
+
+    this->thread = std::thread(&PageStreamer::loadPages, this);
+}
+
+PageStreamer::~PageStreamer() {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+
+    this->condition.notify_all();
+    this->thread.join();
+
+    clReleaseMemObject(this->nodes);
+    clReleaseMemObject(this->bricks);
+    clReleaseMemObject(this->feedback);
+}
+
+void PageStreamer::bind(cl_kernel kernel) const {
+    cl_int error = clSetKernelArg(kernel, 5, sizeof(this->nodes), &this->nodes);
+    checkCLError(error);
+
+    error = clSetKernelArg(kernel, 6, sizeof(this->bricks), &this->bricks);
+    checkCLError(error);
+
+    error = clSetKernelArg(kernel, 19, sizeof(this->feedback), &this->feedback);
+    checkCLError(error);
+
+    // x: the first slot's node, y: nodes per slot, z: number of pages, w: current frame
+    const SvoHeader& header = this->file.getHeader();
+    cl_uint paging[4] = {header.topNodeCount, this->slotNodes, header.pageCount, this->frame};
+
+    error = clSetKernelArg(kernel, 20, sizeof(paging), paging);
+    checkCLError(error);
+}
+
+void PageStreamer::loadPages() {
+    std::unique_lock<std::mutex> lock(this->mutex);
+
+    while (true) {
+        this->condition.wait(lock, [this] { return this->stopping || !this->pending.empty(); });
+        if (this->stopping) return;
+
+        Load load = std::move(this->pending.front());
+        this->pending.pop_front();
+        this->reading++;
+
+        lock.unlock();
+
+        uint firstNode = this->file.getHeader().topNodeCount + load.slot * this->slotNodes;
+
+        try {
+            this->file.readPage(load.page, firstNode, load.slot * this->slotBrickWords, &load.nodes, &load.bricks);
+        } catch (...) {
+            // Nothing more is read, the error is thrown again by the next upload
+            lock.lock();
+            this->failure = std::current_exception();
+            this->reading--;
+            this->condition.notify_all();
+            return;
+        }
+
+        lock.lock();
+
+        this->loaded.push_back(std::move(load));
+        this->reading--;
+        this->condition.notify_all();
+    }
+}
+
+void PageStreamer::upload() {
+    // The previous uploads have finished along with the previous frame
+    this->uploading.clear();
+
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->condition.wait(lock, [this] { return this->failure || (this->pending.empty() && this->reading == 0); });
+        if (this->failure) std::rethrow_exception(this->failure);
+
+        this->uploading.swap(this->loaded);
+    }
+
+    uint topNodeCount = this->file.getHeader().topNodeCount;
+
+    for (const Load& load : this->uploading) {
+        size_t firstNode = topNodeCount + size_t(load.slot) * this->slotNodes;
+        cl_int error = clEnqueueWriteBuffer(this->queue, this->nodes, CL_FALSE, firstNode * sizeof(Node),
+                                            load.nodes.size() * sizeof(Node), load.nodes.data(), 0, nullptr, nullptr);
+        checkCLError(error);
+
+        if (!load.bricks.empty()) {
+            size_t firstBrickWord = size_t(load.slot) * this->slotBrickWords;
+            error = clEnqueueWriteBuffer(this->queue, this->bricks, CL_FALSE, firstBrickWord * sizeof(uint),
+                                         load.bricks.size() * sizeof(uint), load.bricks.data(), 0, nullptr, nullptr);
+            checkCLError(error);
+        }
+
+        // The page becomes visible once its root replaces the NODE_PAGE node
+        uint node = this->file.getPage(load.page).node;
+        error = clEnqueueWriteBuffer(this->queue, this->nodes, CL_FALSE, node * sizeof(Node),
+                                     sizeof(Node), load.nodes.data(), 0, nullptr, nullptr);
+        checkCLError(error);
+    }
+}
+
+void PageStreamer::update() {
+    const SvoHeader& header = this->file.getHeader();
+
+    std::vector<uint> requests(1 + MAX_PAGE_REQUESTS);
+    cl_int error = clEnqueueReadBuffer(this->queue, this->feedback, CL_TRUE, 0, requests.size() * sizeof(uint),
+                                       requests.data(), 0, nullptr, nullptr);
+    checkCLError(error);
+
+    std::vector<uint> usage(this->slotCount);
+    error = clEnqueueReadBuffer(this->queue, this->feedback, CL_TRUE, (1 + MAX_PAGE_REQUESTS + header.pageCount) * sizeof(uint),
+                                usage.size() * sizeof(uint), usage.data(), 0, nullptr, nullptr);
+    checkCLError(error);
+
+    // Pages that were not used by the last frame may be replaced, the least recently used first
+    std::vector<uint> replaceable;
+    for (uint slot = 0; slot < this->slotCount; ++slot) {
+        this->slotUsage[slot] = std::max(this->slotUsage[slot], usage[slot]);
+
+        if (this->slotPages[slot] != NO_SLOT && this->slotUsage[slot] < this->frame) replaceable.push_back(slot);
+    }
+
+    std::sort(replaceable.begin(), replaceable.end(), [this](uint a, uint b) {
+        return this->slotUsage[a] > this->slotUsage[b];
+    });
+
+    uint requestCount = std::min(requests[0], MAX_PAGE_REQUESTS);
+
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+
+        for (uint i = 0; i < requestCount; ++i) {
+            uint page = requests[1 + i];
+            if (page >= header.pageCount || this->pageSlots[page] != NO_SLOT) continue;
+
+            uint slot;
+            if (!this->freeSlots.empty()) {
+                slot = this->freeSlots.back();
+                this->freeSlots.pop_back();
+            } else if (!replaceable.empty()) {
+                slot = replaceable.back();
+                replaceable.pop_back();
+                this->evict(slot);
+            } else {
+                // Every page is in use, so the page has to be asked for again later
+                this->writeFlag(page, 0);
+                continue;
+            }
+
+            this->slotPages[slot] = page;
+            this->pageSlots[page] = slot;
+            this->slotUsage[slot] = this->frame;
+
+            this->pending.push_back(Load{page, slot, {}, {}});
+        }
+    }
+
+    this->condition.notify_all();
+
+    cl_uint zero = 0;
+    error = clEnqueueWriteBuffer(this->queue, this->feedback, CL_TRUE, 0, sizeof(zero), &zero, 0, nullptr, nullptr);
+    checkCLError(error);
+
+    this->frame++;
+}
+
+void PageStreamer::evict(uint slot) {
+    uint page = this->slotPages[slot];
+    uint node = this->file.getPage(page).node;
+
+    // The file stays mapped, so the original node can be uploaded straight from it
+    cl_int error = clEnqueueWriteBuffer(this->queue, this->nodes, CL_FALSE, node * sizeof(Node), sizeof(Node),
+                                        this->file.getTopNodes() + node, 0, nullptr, nullptr);
+    checkCLError(error);
+
+    this->writeFlag(page, 0);
+
+    this->pageSlots[page] = NO_SLOT;
+    this->slotPages[slot] = NO_SLOT;
+}
+
+void PageStreamer::writeFlag(uint page, uint value) {
+    size_t offset = (1 + MAX_PAGE_REQUESTS + page) * sizeof(uint);
+    cl_int error = clEnqueueWriteBuffer(this->queue, this->feedback, CL_TRUE, offset, sizeof(value), &value, 0, nullptr, nullptr);
+    checkCLError(error);
+}
+
+uint PageStreamer::getResidentPages() const {
+    return this->slotCount - static_cast<uint>(this->freeSlots.size());
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "OpenCL.h"
+#include "Svo.h"
+
+
+/// The most pages the kernel can ask for in a single frame, must match the kernel
+const uint MAX_PAGE_REQUESTS = 256;
+
+
+/// Keeps the top of a streamed octree on the device, and the pages below it in a fixed pool of slots.
+///
+/// The kernel asks for pages it runs into that are not resident, and marks the slots it enters as used,
+/// through a feedback buffer laid out as:
+///
+///     [request count] [requested pages...] [requested flag of every page...] [last use of every slot...]
+///
+/// After every frame the requested pages are read from the file by a separate thread, replacing the least
+/// recently used pages, and they are uploaded before the next frame starts.
+class PageStreamer {
+    const SvoFile& file;
+
+    cl_command_queue queue;
+
+    /// The top of the tree followed by the node slots, and the brick slots
+    cl_mem nodes, bricks;
+    cl_mem feedback;
+
+    uint slotCount, slotNodes, slotBrickWords;
+
+    /// The number of the current frame, slots are marked with the frame they were last used in
+    uint frame;
+
+    /// The page stored in every slot, the slot of every page, and the slots that hold no page
+    std::vector<uint> slotPages, pageSlots, freeSlots;
+    std::vector<uint> slotUsage;
+
+    /// A page read from the file, ready to be uploaded to its slot
+    struct Load {
+        uint page, slot;
+        std::vector<Node> nodes;
+        std::vector<uint> bricks;
+    };
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping;
+
+    /// Pages waiting to be read, being read and that have been read, guarded by the mutex
+    std::deque<Load> pending;
+    uint reading;
+    std::vector<Load> loaded;
+
+    /// Why reading a page failed, guarded by the mutex
+    std::exception_ptr failure;
+
+    /// Pages that are being uploaded, they are kept alive until the uploads have finished
+    std::vector<Load> uploading;
+
+    void loadPages();
+
+    /// Put a page's NODE_PAGE node back into the top of the tree
+    void evict(uint slot);
+
+    void writeFlag(uint page, uint value);
+
+public:
+
+    /// Allocate as many slots as fit in `memory` bytes, but never more than there are pages
+    PageStreamer(const SvoFile& file, cl_context context, cl_command_queue queue, size_t memory);
+    ~PageStreamer();
+
+    PageStreamer(const PageStreamer&) = delete;
+    PageStreamer& operator=(const PageStreamer&) = delete;
+
+    /// Bind the nodes, bricks and feedback to the kernel
+    void bind(cl_kernel kernel) const;
+
+    /// Wait for the pages requested by the last frame to be read, and upload them
+    void upload();
+
+    /// Read the feedback of a finished frame, and start reading the pages it asked for
+    void update();
+
+    uint getResidentPages() const;
+};
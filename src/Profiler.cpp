@@ -0,0 +1,100 @@
+#include "Profiler.h"
+
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+
+Profiler::Profiler(std::vector<std::string> phases, size_t window) :
+        phases(std::move(phases)), window(window), current(this->phases.size(), EventTimes{0, 0, 0, 0}), frameCount(0) {
+}
+
+EventTimes Profiler::record(size_t phase, cl_event event) {
+    EventTimes& times = this->current[phase];
+
+    cl_int error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &times.queued, nullptr);
+    checkCLError(error);
+
+    error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &times.submit, nullptr);
+    checkCLError(error);
+
+    error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &times.start, nullptr);
+    checkCLError(error);
+
+    error = clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &times.end, nullptr);
+    checkCLError(error);
+
+    clReleaseEvent(event);
+    return times;
+}
+
+void Profiler::endFrame(double hostMilliseconds) {
+    this->frames.push_back(this->current);
+    this->hostTimes.push_back(hostMilliseconds);
+
+    if (this->frames.size() > this->window) {
+        this->frames.pop_front();
+        this->hostTimes.pop_front();
+    }
+
+    std::fill(this->current.begin(), this->current.end(), EventTimes{0, 0, 0, 0});
+    this->frameCount++;
+}
+
+void Profiler::report(std::ostream& out) const {
+    if (this->frames.empty()) return;
+
+    auto count = static_cast<double>(this->frames.size());
+    double device = 0;
+
+    out << std::fixed << std::setprecision(3);
+
+    for (size_t phase = 0; phase < this->phases.size(); ++phase) {
+        double queued = 0, submitted = 0, running = 0;
+
+        for (const std::vector<EventTimes>& frame : this->frames) {
+            const EventTimes& times = frame[phase];
+            queued += (times.submit - times.queued) * 1e-6;
+            submitted += (times.start - times.submit) * 1e-6;
+            running += (times.end - times.start) * 1e-6;
+        }
+
+        device += running;
+
+        out << this->phases[phase] << ": queued " << queued / count << " ms, submitted "
+            << submitted / count << " ms, running " << running / count << " ms\n";
+    }
+
+    double host = 0;
+    for (double time : this->hostTimes) host += time;
+
+    out << "frame: " << host / count << " ms, of which " << (host - device) / count << " ms outside the device\n";
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+void Profiler::write(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Failed to create file: " + path);
+
+    file << "frame,phase,queued_ns,submit_ns,start_ns,end_ns,host_ms\n";
+
+    size_t firstFrame = this->frameCount - this->frames.size();
+
+    for (size_t i = 0; i < this->frames.size(); ++i) {
+        const std::vector<EventTimes>& frame = this->frames[i];
+
+        cl_ulong origin = frame[0].queued;
+        for (const EventTimes& times : frame) {
+            if (times.queued != 0) origin = std::min(origin, times.queued);
+        }
+
+        for (size_t phase = 0; phase < this->phases.size(); ++phase) {
+            const EventTimes& times = frame[phase];
+
+            file << firstFrame + i << "," << this->phases[phase] << ","
+                 << times.queued - origin << "," << times.submit - origin << ","
+                 << times.start - origin << "," << times.end - origin << ","
+                 << this->hostTimes[i] << "\n";
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <ostream>
+
+#include "OpenCL.h"
+
+
+/// When a command was queued, submitted to the device, started and ended, in nanoseconds on the device's clock
+struct EventTimes {
+    cl_ulong queued, submit, start, end;
+};
+
+
+/// Collects the profiling information of the commands in every phase of a frame over the last frames.
+///
+/// Events need a queue created with CL_QUEUE_PROFILING_ENABLE.
+class Profiler {
+    std::vector<std::string> phases;
+
+    /// The number of frames that are kept
+    size_t window;
+
+    /// The times of every phase, and how long the whole frame took on the host in milliseconds, oldest first
+    std::deque<std::vector<EventTimes>> frames;
+    std::deque<double> hostTimes;
+
+    std::vector<EventTimes> current;
+
+    /// The number of frames that have been recorded, including those that are no longer kept
+    size_t frameCount;
+
+public:
+
+    explicit Profiler(std::vector<std::string> phases, size_t window = 120);
+
+    /// Record the times of a phase's command in the current frame, release its event and return the times.
+    /// The command must have completed.
+    EventTimes record(size_t phase, cl_event event);
+
+    /// Finish the current frame, which took `hostMilliseconds` on the host from start to finish
+    void endFrame(double hostMilliseconds);
+
+    /// Print the average latencies of every phase over the kept frames
+    void report(std::ostream& out) const;
+
+    /// Write the times of every kept frame as CSV, relative to the first command of its frame
+    void write(const std::string& path) const;
+};
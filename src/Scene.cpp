@@ -0,0 +1,247 @@
+#include "Scene.h"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <stdexcept>
+
+
+/// The largest number of instances in a leaf of the hierarchy
+const uint BVH_LEAF_SIZE = 4;
+
+
+Scene::Scene() {
+    // Child index 0 means empty, so the first node can never be used
+    this->nodes.emplace_back(0);
+    this->distances.resize(8, 0);
+    this->distanceLevels.push_back(0);
+}
+
+
+uint Scene::addModel(const Octree& octree) {
+    return this->addAnimation(std::vector<Octree>{octree});
+}
+
+
+uint Scene::addAnimation(const std::vector<Octree>& frames) {
+    if (frames.empty()) throw std::runtime_error("A model needs at least one frame");
+
+    Model model{};
+    model.firstFrame = static_cast<uint>(this->frames.size());
+    model.frameCount = static_cast<uint>(frames.size());
+
+    std::fill(model.min, model.min + 3, INT_MAX);
+    std::fill(model.max, model.max + 3, INT_MIN);
+
+    for (const Octree& frame : frames) {
+        this->addFrame(frame, model.min, model.max);
+    }
+
+    // An empty model has no bounds, which makes every ray miss its instances
+    if (model.min[0] > model.max[0]) {
+        std::fill(model.min, model.min + 3, 0);
+        std::fill(model.max, model.max + 3, 0);
+    }
+
+    this->models.push_back(model);
+    return static_cast<uint>(this->models.size() - 1);
+}
+
+
+void Scene::addFrame(const Octree& octree, int min[3], int max[3]) {
+    Frame frame{};
+    uchar distanceLevel;
+    std::vector<uchar> octreeDistances = computeEmptyDistances(octree.getNodes(), &distanceLevel);
+
+    frame.root = this->internNode(octree, 0, octreeDistances, distanceLevel);
+    frame.distanceLevel = distanceLevel;
+    this->frames.push_back(frame);
+
+    octree.growOccupiedBounds(min, max);
+}
+
+
+uint Scene::internNode(const Octree& octree, uint index, const std::vector<uchar>& octreeDistances, uchar distanceLevel) {
+    Node node = octree.getNodeData()[index];
+
+    // Children are added first, so that identical subtrees end up with identical child indices
+    if (node.flags & NODE_BRICK) {
+        uint level = node.size;
+        node.children[0] = this->internBrick(octree.getBrickData() + node.children[0], brickWords(static_cast<uchar>(level)));
+    } else if (!(node.flags & NODE_LEAF)) {
+        for (uint& child : node.children) {
+            if (child != 0) child = this->internNode(octree, child, octreeDistances, distanceLevel);
+        }
+    }
+
+    std::string key(reinterpret_cast<const char*>(node.children), sizeof(node.children));
+    key += static_cast<char>(node.size);
+    key += static_cast<char>(node.flags);
+    key += static_cast<char>(node.mask);
+
+    const uchar* nodeDistances = &octreeDistances[8 * index];
+
+    auto found = this->nodeLookup.find(key);
+    if (found != this->nodeLookup.end()) {
+        // The node is shared, so only distances that hold in every frame can be kept
+        uint shared = found->second;
+
+        for (uint i = 0; i < 8; ++i) {
+            uchar& distance = this->distances[8 * shared + i];
+            distance = this->distanceLevels[shared] == distanceLevel ? std::min(distance, nodeDistances[i]) : uchar(0);
+        }
+
+        return shared;
+    }
+
+    auto added = static_cast<uint>(this->nodes.size());
+    this->nodes.push_back(node);
+    this->distances.insert(this->distances.end(), nodeDistances, nodeDistances + 8);
+    this->distanceLevels.push_back(distanceLevel);
+
+    this->nodeLookup[key] = added;
+    return added;
+}
+
+
+uint Scene::internBrick(const uint* words, uint count) {
+    std::string key(reinterpret_cast<const char*>(words), count * sizeof(uint));
+
+    auto found = this->brickLookup.find(key);
+    if (found != this->brickLookup.end()) return found->second;
+
+    auto offset = static_cast<uint>(this->bricks.size());
+    this->bricks.insert(this->bricks.end(), words, words + count);
+
+    this->brickLookup[key] = offset;
+    return offset;
+}
+
+
+void Scene::addInstance(uint model, int x, int y, int z, int quarterTurns, uint frameOffset) {
+    if (model >= this->models.size()) throw std::runtime_error("Instance of a model that does not exist");
+
+    const Model& source = this->models[model];
+
+    // Rotations around the y-axis of 0, 90, 180 and 270 degrees
+    static const int COS[4] = {1, 0, -1, 0};
+    static const int SIN[4] = {0, 1, 0, -1};
+    int turn = ((quarterTurns % 4) + 4) % 4;
+
+    Instance instance{};
+    int rotation[9] = {
+            COS[turn], 0, SIN[turn],
+            0, 1, 0,
+            -SIN[turn], 0, COS[turn]
+    };
+    std::copy(rotation, rotation + 9, instance.rotation);
+
+    instance.translation[0] = x;
+    instance.translation[1] = y;
+    instance.translation[2] = z;
+    instance.firstFrame = source.firstFrame;
+    instance.frameCount = source.frameCount;
+    instance.frameOffset = frameOffset;
+
+    // Every row picks a single axis of the model, possibly flipped
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) {
+            int sign = rotation[3 * row + column];
+            if (sign == 0) continue;
+
+            float a = sign * source.min[column], b = sign * source.max[column];
+            instance.min[row] = instance.translation[row] + std::min(a, b);
+            instance.max[row] = instance.translation[row] + std::max(a, b);
+        }
+    }
+
+    this->instances.push_back(instance);
+}
+
+
+void Scene::buildBvh() {
+    this->bvh.clear();
+    if (this->instances.empty()) return;
+
+    this->bvh.push_back(BvhNode{});
+    this->buildBvhNode(0, 0, static_cast<uint>(this->instances.size()));
+}
+
+
+void Scene::buildBvhNode(uint index, uint first, uint count) {
+    BvhNode node{};
+    std::fill(node.min, node.min + 3, INFINITY);
+    std::fill(node.max, node.max + 3, -INFINITY);
+
+    float centerMin[3] = {INFINITY, INFINITY, INFINITY};
+    float centerMax[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+    for (uint i = first; i < first + count; ++i) {
+        const Instance& instance = this->instances[i];
+
+        for (int axis = 0; axis < 3; ++axis) {
+            node.min[axis] = std::min(node.min[axis], instance.min[axis]);
+            node.max[axis] = std::max(node.max[axis], instance.max[axis]);
+
+            float center = instance.min[axis] + instance.max[axis];
+            centerMin[axis] = std::min(centerMin[axis], center);
+            centerMax[axis] = std::max(centerMax[axis], center);
+        }
+    }
+
+    if (count <= BVH_LEAF_SIZE) {
+        node.first = first;
+        node.count = count;
+        this->bvh[index] = node;
+        return;
+    }
+
+    // Split the instances in half along the axis where their centers are the most spread out
+    int axis = 0;
+    for (int i = 1; i < 3; ++i) {
+        if (centerMax[i] - centerMin[i] > centerMax[axis] - centerMin[axis]) axis = i;
+    }
+
+    uint half = count / 2;
+    std::nth_element(this->instances.begin() + first, this->instances.begin() + first + half,
+                     this->instances.begin() + first + count,
+                     [axis](const Instance& a, const Instance& b) {
+                         return a.min[axis] + a.max[axis] < b.min[axis] + b.max[axis];
+                     });
+
+    auto left = static_cast<uint>(this->bvh.size());
+    this->bvh.push_back(BvhNode{});
+    this->bvh.push_back(BvhNode{});
+
+    node.first = left;
+    node.count = 0;
+    this->bvh[index] = node;
+
+    this->buildBvhNode(left, first, half);
+    this->buildBvhNode(left + 1, first + half, count - half);
+}
+
+
+const std::vector<Frame>& Scene::getFrames() const {
+    return this->frames;
+}
+
+const std::vector<Node>& Scene::getNodes() const {
+    return this->nodes;
+}
+
+const std::vector<uint>& Scene::getBricks() const {
+    return this->bricks;
+}
+
+const std::vector<uchar>& Scene::getDistances() const {
+    return this->distances;
+}
+
+const std::vector<Instance>& Scene::getInstances() const {
+    return this->instances;
+}
+
+const std::vector<BvhNode>& Scene::getBvh() const {
+    return this->bvh;
+}
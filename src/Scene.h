@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <unordered_map>
+#include <string>
+
+#include "Octree.h"
+
+
+/// A model placed in the world, laid out as the kernel expects it
+struct Instance {
+    /// The world space bounds of the model's voxels
+    float min[3], max[3];
+
+    /// Rotation from model space to world space, stored row by row.
+    /// Every row has a single non-zero entry of either 1 or -1
+    int rotation[9];
+
+    /// The world space position of the model's origin
+    int translation[3];
+
+    /// The model's animation frames, and how many frames this instance is ahead of the others
+    uint firstFrame, frameCount, frameOffset;
+};
+
+
+/// A single animation frame of a model, laid out as the kernel expects it
+struct Frame {
+    /// The index of the frame's root in the shared node buffer
+    uint root;
+
+    /// The logarithmic size of the cells used for the frame's empty space distances
+    uint distanceLevel;
+};
+
+
+/// A node in the bounding volume hierarchy over the instances
+struct BvhNode {
+    float min[3], max[3];
+
+    /// Leaves cover `count` instances starting at `first`.
+    /// Inner nodes have a count of 0, and their children are at `first` and `first + 1`
+    uint first, count;
+};
+
+
+/// A set of models stored once, and any number of instances of them.
+///
+/// All models share a single node and brick buffer, so an instance only costs the size of its transform.
+/// Identical subtrees are only stored once, no matter which model or animation frame they come from,
+/// so the frames of an animation only cost what changes between them.
+class Scene {
+
+    struct Model {
+        uint firstFrame, frameCount;
+
+        /// The bounds of the occupied nodes of every frame in model space
+        int min[3], max[3];
+    };
+
+    std::vector<Model> models;
+    std::vector<Frame> frames;
+
+    std::vector<Node> nodes;
+    std::vector<uint> bricks;
+    std::vector<uchar> distances;
+
+    /// The logarithmic size of the distance cells of every node, nodes shared by frames with
+    /// different cell sizes get no distances at all
+    std::vector<uchar> distanceLevels;
+
+    /// Find nodes and bricks by their contents
+    std::unordered_map<std::string, uint> nodeLookup, brickLookup;
+
+    std::vector<Instance> instances;
+    std::vector<BvhNode> bvh;
+
+public:
+
+    Scene();
+
+    /// Add a model and return its index
+    uint addModel(const Octree& octree);
+
+    /// Add a model with several animation frames and return its index
+    uint addAnimation(const std::vector<Octree>& frames);
+
+    /// Place a model in the world, rotated a number of quarter turns around the y-axis.
+    /// Animated models are started `frameOffset` frames ahead
+    void addInstance(uint model, int x, int y, int z, int quarterTurns = 0, uint frameOffset = 0);
+
+    /// Build the hierarchy over all instances, this reorders the instances
+    void buildBvh();
+
+    const std::vector<Frame>& getFrames() const;
+    const std::vector<Node>& getNodes() const;
+    const std::vector<uint>& getBricks() const;
+    const std::vector<uchar>& getDistances() const;
+    const std::vector<Instance>& getInstances() const;
+    const std::vector<BvhNode>& getBvh() const;
+
+private:
+    /// Add a frame to the shared buffers, and grow the bounds by its occupied nodes
+    void addFrame(const Octree& octree, int min[3], int max[3]);
+
+    /// Add a node of an octree, and everything below it, reusing identical nodes that have already been added
+    uint internNode(const Octree& octree, uint index, const std::vector<uchar>& octreeDistances, uchar distanceLevel);
+
+    /// Add a brick, reusing an identical brick if one has already been added
+    uint internBrick(const uint* words, uint count);
+
+    /// Build the node at `index` covering `count` instances starting at `first`
+    void buildBvhNode(uint index, uint first, uint count);
+};
@@ -0,0 +1,280 @@
+#include "Svo.h"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+const uint SVO_VERSION = 1;
+
+
+/// Splits an octree into its top and its pages while writing it
+struct SvoWriter {
+    const std::vector<Node>& nodes;
+    const std::vector<uint>& bricks;
+    uchar brickLevel, pageLevel;
+
+    std::ofstream& file;
+
+    std::vector<Node> topNodes;
+    std::vector<SvoPage> pages;
+    uint maxPageNodes, maxPageBrickWords;
+
+
+    /// Copy a node of the top of the tree, and return its new index
+    uint writeTop(uint index) {
+        auto topIndex = static_cast<uint>(this->topNodes.size());
+        const Node& node = nodes[index];
+
+        if (node.size == pageLevel && !(node.flags & NODE_LEAF)) {
+            Node stub(node.size);
+            stub.flags = NODE_PAGE;
+            stub.children[0] = static_cast<uint>(this->pages.size());
+            this->topNodes.push_back(stub);
+
+            this->writePage(index, topIndex);
+            return topIndex;
+        }
+
+        this->topNodes.push_back(node);
+
+        if (!(node.flags & NODE_LEAF)) {
+            for (int i = 0; i < 8; ++i) {
+                if (node.children[i] == 0) continue;
+
+                uint child = this->writeTop(node.children[i]);
+                this->topNodes[topIndex].children[i] = child;
+            }
+        }
+
+        return topIndex;
+    }
+
+    /// Copy a node, and everything below it, to the end of a page and return its index within the page
+    uint copyPageNode(uint index, std::vector<Node>& pageNodes, std::vector<uint>& pageBricks) {
+        auto pageIndex = static_cast<uint>(pageNodes.size());
+        pageNodes.push_back(nodes[index]);
+
+        const Node& node = nodes[index];
+
+        if (node.flags & NODE_BRICK) {
+            auto offset = static_cast<uint>(pageBricks.size());
+            const uint* words = &this->bricks[node.children[0]];
+            pageBricks.insert(pageBricks.end(), words, words + brickWords(brickLevel));
+
+            pageNodes[pageIndex].children[0] = offset;
+        } else if (!(node.flags & NODE_LEAF)) {
+            for (int i = 0; i < 8; ++i) {
+                if (node.children[i] == 0) continue;
+
+                uint child = this->copyPageNode(node.children[i], pageNodes, pageBricks);
+                pageNodes[pageIndex].children[i] = child;
+            }
+        }
+
+        return pageIndex;
+    }
+
+    void writePage(uint index, uint topIndex) {
+        std::vector<Node> pageNodes;
+        std::vector<uint> pageBricks;
+        this->copyPageNode(index, pageNodes, pageBricks);
+
+        SvoPage page{};
+        page.offset = static_cast<uint64_t>(this->file.tellp());
+        page.node = topIndex;
+        page.nodeCount = static_cast<uint>(pageNodes.size());
+        page.brickWordCount = static_cast<uint>(pageBricks.size());
+        this->pages.push_back(page);
+
+        this->maxPageNodes = std::max(this->maxPageNodes, page.nodeCount);
+        this->maxPageBrickWords = std::max(this->maxPageBrickWords, page.brickWordCount);
+
+        this->file.write(reinterpret_cast<const char*>(pageNodes.data()), pageNodes.size() * sizeof(Node));
+        this->file.write(reinterpret_cast<const char*>(pageBricks.data()), pageBricks.size() * sizeof(uint));
+    }
+};
+
+
+void writeSvo(const std::string& path, const Octree& octree, uchar pageLevel,
+              const uint palette[256], const VoxMaterial materials[256]) {
+    const std::vector<Node>& nodes = octree.getNodes();
+
+    if (pageLevel <= octree.getBrickLevel() || pageLevel >= nodes[0].size) {
+        throw std::runtime_error("Pages must be smaller than the octree and larger than its bricks");
+    }
+
+    std::ofstream file(path, std::ios::binary);
+    if (!file) throw std::runtime_error("Failed to create file: " + path);
+
+    // The header is written again once everything else is known
+    SvoHeader header{};
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    SvoWriter writer{nodes, octree.getBricks(), octree.getBrickLevel(), pageLevel, file, {}, {}, 0, 0};
+    writer.writeTop(0);
+
+    // Keep the page table aligned
+    while (file.tellp() % sizeof(uint64_t) != 0) file.put(0);
+
+    std::memcpy(header.magic, "SVO ", 4);
+    header.version = SVO_VERSION;
+    header.brickLevel = octree.getBrickLevel();
+    header.pageLevel = pageLevel;
+    header.topNodeCount = static_cast<uint>(writer.topNodes.size());
+    header.pageCount = static_cast<uint>(writer.pages.size());
+    header.maxPageNodes = writer.maxPageNodes;
+    header.maxPageBrickWords = writer.maxPageBrickWords;
+    std::copy(palette, palette + 256, header.palette);
+    std::copy(materials, materials + 256, header.materials);
+
+    header.pageTableOffset = static_cast<uint64_t>(file.tellp());
+    file.write(reinterpret_cast<const char*>(writer.pages.data()), writer.pages.size() * sizeof(SvoPage));
+
+    header.topOffset = static_cast<uint64_t>(file.tellp());
+    file.write(reinterpret_cast<const char*>(writer.topNodes.data()), writer.topNodes.size() * sizeof(Node));
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    if (!file) throw std::runtime_error("Failed to write file: " + path);
+}
+
+
+/// Whether `bytes` starting at `offset` lie within a file of `size` bytes, without overflowing
+static bool withinFile(uint64_t offset, uint64_t bytes, size_t size) {
+    return offset <= size && bytes <= size - offset;
+}
+
+
+bool SvoFile::isValid() const {
+    const SvoHeader& header = *this->header;
+
+    if (std::memcmp(header.magic, "SVO ", 4) != 0 || header.version != SVO_VERSION || header.topNodeCount == 0 ||
+        header.pageLevel <= header.brickLevel || header.pageLevel >= 32 ||
+        !withinFile(header.pageTableOffset, uint64_t(header.pageCount) * sizeof(SvoPage), this->size) ||
+        !withinFile(header.topOffset, uint64_t(header.topNodeCount) * sizeof(Node), this->size)) {
+        return false;
+    }
+
+    auto pages = reinterpret_cast<const SvoPage*>(this->data + header.pageTableOffset);
+    auto topNodes = reinterpret_cast<const Node*>(this->data + header.topOffset);
+
+    // Pages are only read when they are needed, so their nodes are checked by `readPage`
+    for (uint page = 0; page < header.pageCount; ++page) {
+        const SvoPage& info = pages[page];
+        uint64_t bytes = uint64_t(info.nodeCount) * sizeof(Node) + uint64_t(info.brickWordCount) * sizeof(uint);
+
+        if (info.nodeCount == 0 || info.nodeCount > header.maxPageNodes || info.brickWordCount > header.maxPageBrickWords ||
+            info.node >= header.topNodeCount || !withinFile(info.offset, bytes, this->size)) {
+            return false;
+        }
+    }
+
+    // The top of the tree ends above the bricks, in leaves and pages
+    for (uint index = 0; index < header.topNodeCount; ++index) {
+        const Node& node = topNodes[index];
+
+        if (node.flags & NODE_BRICK) return false;
+        if (node.flags & NODE_LEAF) continue;
+
+        if (node.flags & NODE_PAGE) {
+            if (node.children[0] >= header.pageCount) return false;
+            continue;
+        }
+
+        for (uint child : node.children) {
+            if (child >= header.topNodeCount) return false;
+        }
+    }
+
+    return true;
+}
+
+
+SvoFile::SvoFile(const std::string& path) {
+    this->descriptor = open(path.c_str(), O_RDONLY);
+    if (this->descriptor < 0) throw std::runtime_error("Failed to open file: " + path);
+
+    struct stat info{};
+    fstat(this->descriptor, &info);
+    this->size = static_cast<size_t>(info.st_size);
+
+    if (this->size < sizeof(SvoHeader)) {
+        close(this->descriptor);
+        throw std::runtime_error("Not an .svo file: " + path);
+    }
+
+    void* mapping = mmap(nullptr, this->size, PROT_READ, MAP_PRIVATE, this->descriptor, 0);
+    if (mapping == MAP_FAILED) {
+        close(this->descriptor);
+        throw std::runtime_error("Failed to map file: " + path);
+    }
+
+    // Pages are requested in whatever order the camera sees them
+    madvise(mapping, this->size, MADV_RANDOM);
+
+    this->data = static_cast<const char*>(mapping);
+    this->header = reinterpret_cast<const SvoHeader*>(this->data);
+
+    if (!this->isValid()) {
+        munmap(mapping, this->size);
+        close(this->descriptor);
+        throw std::runtime_error("Not an .svo file: " + path);
+    }
+
+    this->pages = reinterpret_cast<const SvoPage*>(this->data + this->header->pageTableOffset);
+    this->topNodes = reinterpret_cast<const Node*>(this->data + this->header->topOffset);
+}
+
+SvoFile::~SvoFile() {
+    munmap(const_cast<char*>(this->data), this->size);
+    close(this->descriptor);
+}
+
+const SvoHeader& SvoFile::getHeader() const {
+    return *this->header;
+}
+
+const Node* SvoFile::getTopNodes() const {
+    return this->topNodes;
+}
+
+const SvoPage& SvoFile::getPage(uint page) const {
+    return this->pages[page];
+}
+
+void SvoFile::readPage(uint page, uint firstNode, uint firstBrickWord, std::vector<Node>* nodes, std::vector<uint>* bricks) const {
+    const SvoPage& info = this->pages[page];
+
+    auto pageNodes = reinterpret_cast<const Node*>(this->data + info.offset);
+    auto pageBricks = reinterpret_cast<const uint*>(pageNodes + info.nodeCount);
+
+    nodes->assign(pageNodes, pageNodes + info.nodeCount);
+    bricks->assign(pageBricks, pageBricks + info.brickWordCount);
+
+    for (Node& node : *nodes) {
+        if (node.flags & NODE_LEAF) continue;
+
+        if (node.flags & NODE_BRICK) {
+            uint words = brickWords(static_cast<uchar>(this->header->brickLevel));
+            if (node.children[0] > info.brickWordCount || words > info.brickWordCount - node.children[0]) {
+                throw std::runtime_error("Corrupt page in .svo file: " + std::to_string(page));
+            }
+
+            node.children[0] += firstBrickWord;
+            continue;
+        }
+
+        for (uint& child : node.children) {
+            if (child >= info.nodeCount) throw std::runtime_error("Corrupt page in .svo file: " + std::to_string(page));
+            if (child != 0) child += firstNode;
+        }
+    }
+}
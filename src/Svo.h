@@ -0,0 +1,84 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Octree.h"
+#include "Vox.h"
+
+
+/// A subtree of a streamed octree, stored contiguously in an .svo file
+struct SvoPage {
+    /// Where the page's nodes start in the file, they are followed by its bricks
+    uint64_t offset;
+
+    /// The index of the node in the top of the tree that the page replaces
+    uint node;
+
+    /// The number of nodes and brick words in the page, its root is the first node
+    uint nodeCount, brickWordCount;
+
+    uint padding;
+};
+
+
+/// The start of an .svo file.
+///
+/// The file holds the pages' nodes and bricks right after the header, followed by the page table
+/// and the top of the tree. Nodes in the top of the tree at the page level are replaced by NODE_PAGE
+/// nodes referring to their page, and every page is numbered as if it was stored on its own.
+struct SvoHeader {
+    char magic[4];
+    uint version;
+
+    uint brickLevel, pageLevel;
+    uint topNodeCount, pageCount;
+
+    /// The largest page, every page fits in this many nodes and brick words
+    uint maxPageNodes, maxPageBrickWords;
+
+    uint64_t pageTableOffset, topOffset;
+
+    uint palette[256];
+    VoxMaterial materials[256];
+};
+
+
+/// Write an octree to an .svo file, splitting it into pages at nodes with the logarithmic size `pageLevel`
+void writeSvo(const std::string& path, const Octree& octree, uchar pageLevel,
+              const uint palette[256], const VoxMaterial materials[256]);
+
+
+/// An .svo file mapped into memory, only the pages that are read are loaded from disk
+class SvoFile {
+    int descriptor;
+
+    const char* data;
+    size_t size;
+
+    const SvoHeader* header;
+    const SvoPage* pages;
+    const Node* topNodes;
+
+    /// Check the header, the page table and the top of the tree against the size of the file
+    bool isValid() const;
+
+public:
+
+    explicit SvoFile(const std::string& path);
+    ~SvoFile();
+
+    SvoFile(const SvoFile&) = delete;
+    SvoFile& operator=(const SvoFile&) = delete;
+
+    const SvoHeader& getHeader() const;
+
+    const Node* getTopNodes() const;
+
+    const SvoPage& getPage(uint page) const;
+
+    /// Copy a page as it will be stored on the device, with its first node at `firstNode`
+    /// and its bricks starting at `firstBrickWord`. Throws if the page refers to nodes or bricks outside of it
+    void readPage(uint page, uint firstNode, uint firstBrickWord, std::vector<Node>* nodes, std::vector<uint>* bricks) const;
+};
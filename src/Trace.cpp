@@ -0,0 +1,91 @@
+#include "Trace.h"
+#include "Log.h"
+
+#include <chrono>
+#include <fstream>
+#include <stdexcept>
+
+
+/// The most spans that are kept, later spans are dropped so that a long session can't run out of memory
+const size_t MAX_SPANS = 1u << 22;
+
+
+std::atomic<bool> Trace::enabled(false);
+std::mutex Trace::mutex;
+std::vector<Trace::Span> Trace::spans;
+std::vector<std::thread::id> Trace::threads;
+
+static std::chrono::steady_clock::time_point traceStart;
+
+
+void Trace::enable() {
+    traceStart = std::chrono::steady_clock::now();
+    Trace::enabled = true;
+}
+
+bool Trace::isEnabled() {
+    return Trace::enabled;
+}
+
+int64_t Trace::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+void Trace::addHostSpan(const char* name, int64_t start, int64_t end) {
+    if (!Trace::enabled) return;
+
+    std::thread::id id = std::this_thread::get_id();
+
+    std::lock_guard<std::mutex> lock(Trace::mutex);
+    if (Trace::spans.size() >= MAX_SPANS) return;
+
+    uint thread = 0;
+    while (thread < Trace::threads.size() && Trace::threads[thread] != id) thread++;
+    if (thread == Trace::threads.size()) Trace::threads.push_back(id);
+
+    Trace::spans.push_back(Span{name, start, end, false, thread});
+}
+
+void Trace::addDeviceSpan(const char* name, int64_t start, int64_t end) {
+    if (!Trace::enabled) return;
+
+    std::lock_guard<std::mutex> lock(Trace::mutex);
+    if (Trace::spans.size() >= MAX_SPANS) return;
+
+    Trace::spans.push_back(Span{name, start, end, true, 0});
+}
+
+void Trace::write(const std::string& path) {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Failed to create file: " + path);
+
+    std::lock_guard<std::mutex> lock(Trace::mutex);
+
+    // The host and the device show up as separate processes
+    file << "{\"traceEvents\":[\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":\"Host\"}},\n";
+    file << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"Device\"}}";
+
+    file.precision(3);
+    file << std::fixed;
+
+    for (const Span& span : Trace::spans) {
+        file << ",\n{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":" << (span.device ? 1 : 0)
+             << ",\"tid\":" << span.thread << ",\"ts\":" << span.start * 1e-3
+             << ",\"dur\":" << (span.end - span.start) * 1e-3 << "}";
+    }
+
+    file << "\n]}\n";
+
+    if (Trace::spans.size() >= MAX_SPANS) {
+        LOG(WARNING) << "The trace was full, later spans were dropped";
+    }
+}
+
+
+TraceSpan::TraceSpan(const char* name) : name(name), start(Trace::isEnabled() ? Trace::now() : 0) {
+}
+
+TraceSpan::~TraceSpan() {
+    if (Trace::isEnabled()) Trace::addHostSpan(this->name, this->start, Trace::now());
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+
+
+/// Records spans of host and device work, and writes them as a Chrome trace (chrome://tracing).
+///
+/// Nothing is recorded until tracing is enabled, so spans can be left in place.
+class Trace {
+    struct Span {
+        const char* name;
+
+        /// Nanoseconds since tracing was enabled
+        int64_t start, end;
+
+        /// The device gets a track of its own, host threads are numbered in the order they first record a span
+        bool device;
+        uint thread;
+    };
+
+    static std::atomic<bool> enabled;
+    static std::mutex mutex;
+    static std::vector<Span> spans;
+    static std::vector<std::thread::id> threads;
+
+public:
+
+    static void enable();
+    static bool isEnabled();
+
+    /// Nanoseconds since tracing was enabled
+    static int64_t now();
+
+    /// Record a span on the calling thread, `name` must outlive the trace
+    static void addHostSpan(const char* name, int64_t start, int64_t end);
+
+    /// Record a span on the device, with times already moved to the host's clock
+    static void addDeviceSpan(const char* name, int64_t start, int64_t end);
+
+    /// Write every recorded span in the trace event format
+    static void write(const std::string& path);
+};
+
+
+/// Records the time from its construction to its destruction as a span on the calling thread
+class TraceSpan {
+    const char* name;
+    int64_t start;
+
+public:
+    explicit TraceSpan(const char* name);
+    ~TraceSpan();
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+};
@@ -0,0 +1,250 @@
+#include "Traversal.h"
+
+#include <cmath>
+#include <algorithm>
+
+
+/// The deepest octree a ray can descend into. Voxel positions are ints, so no octree is deeper than this,
+/// while the kernel's stack is sized to the octrees it is built for
+const uint MAX_STACK_DEPTH = 32;
+
+
+/// The component wise sign of a vector, 0 for components that are 0
+static glm::vec3 sign(glm::vec3 v) {
+    return glm::vec3(v.x > 0 ? 1 : v.x < 0 ? -1 : 0, v.y > 0 ? 1 : v.y < 0 ? -1 : 0, v.z > 0 ? 1 : v.z < 0 ? -1 : 0);
+}
+
+static float minComponent(glm::vec3 v) { return std::min(v.x, std::min(v.y, v.z)); }
+static float maxComponent(glm::vec3 v) { return std::max(v.x, std::max(v.y, v.z)); }
+
+
+/// Find the times a ray enters and exits a cube along every axis
+static bool cubeIntersection(float size, glm::vec3 origin, glm::vec3 direction, glm::vec3* tEntry, glm::vec3* tExit) {
+    glm::vec3 halfSizes(size / 2.0f);
+
+    glm::vec3 relativePosition = -origin;
+
+    glm::vec3 step = sign(direction);
+    glm::vec3 entry = (relativePosition - step * halfSizes) * (1.0f / direction);
+    glm::vec3 exit = (relativePosition + step * halfSizes) * (1.0f / direction);
+
+    for (int i = 0; i < 3; ++i) {
+        if (direction[i] != 0.0f) continue;
+        if (relativePosition[i] + halfSizes[i] < 0.0f || relativePosition[i] - halfSizes[i] > 0.0f) return false;
+
+        entry[i] = -INFINITY;
+        exit[i] = INFINITY;
+    }
+
+    if (maxComponent(entry) >= minComponent(exit)) return false;
+
+    *tEntry = entry;
+    *tExit = exit;
+    return true;
+}
+
+
+static uint firstChild(float tEnter, glm::vec3 tMid) {
+    uint index = 0;
+
+    if (tEnter > tMid.x) index ^= 0b100;
+    if (tEnter > tMid.y) index ^= 0b010;
+    if (tEnter > tMid.z) index ^= 0b001;
+
+    return index;
+}
+
+
+static void getChildT(uint childIndex, glm::vec3 t0, glm::vec3 tMid, glm::vec3 t1, glm::vec3* t0Child, glm::vec3* t1Child) {
+    for (int axis = 0; axis < 3; ++axis) {
+        bool upper = (childIndex & (0b100 >> axis)) != 0;
+        (*t0Child)[axis] = upper ? tMid[axis] : t0[axis];
+        (*t1Child)[axis] = upper ? t1[axis] : tMid[axis];
+    }
+}
+
+
+/// The child the ray enters after leaving one, sets `exitNode` if it leaves the node instead
+static uint getNextChild(uint childIndex, glm::vec3 t1, bool* exitNode) {
+    uint bit;
+
+    if (t1.x < t1.y) {
+        bit = t1.x < t1.z ? 0b100 : 0b001;
+    } else {
+        bit = t1.y < t1.z ? 0b010 : 0b001;
+    }
+
+    if (childIndex & bit) *exitNode = true;
+    return childIndex | bit;
+}
+
+
+/// Reorder the occupancy bits of a node so that bit i tells if the mirrored child i is occupied
+static uint mirrorMask(uint mask, uint dirMask) {
+    if (dirMask & 4) mask = ((mask & 0x0f) << 4) | ((mask & 0xf0) >> 4);
+    if (dirMask & 2) mask = ((mask & 0x33) << 2) | ((mask & 0xcc) >> 2);
+    if (dirMask & 1) mask = ((mask & 0x55) << 1) | ((mask & 0xaa) >> 1);
+    return mask;
+}
+
+
+/// The children a ray can still visit after the child at childIndex
+static uint remainingChildren(uint childIndex) {
+    uint mask = 0xff;
+    if (childIndex & 0b100) mask &= 0xf0;
+    if (childIndex & 0b010) mask &= 0xcc;
+    if (childIndex & 0b001) mask &= 0xaa;
+    return mask;
+}
+
+
+/// Step through a dense brick, whose entry and exit times are mirrored according to dirMask
+static bool traceBrick(const uint* brick, uint level, uint dirMask, float t, glm::vec3 t0, glm::vec3 t1,
+                       glm::vec3 direction, RayHit* hit, size_t* steps) {
+    int dim = 1 << level;
+    glm::vec3 cellT = (t1 - t0) / float(dim);
+
+    float tEntry = std::max(t, maxComponent(t0));
+    glm::ivec3 cell = glm::clamp(glm::ivec3(glm::floor((tEntry - t0) / cellT)), 0, dim - 1);
+    glm::vec3 tNext = t0 + glm::vec3(cell + 1) * cellT;
+
+    int axis = 2;
+    if (tEntry == t0.x) axis = 0;
+    else if (tEntry == t0.y) axis = 1;
+
+    const uint* payload = brick + brickOccupancyWords(static_cast<uchar>(level));
+
+    while (true) {
+        if (steps) *steps += 1;
+
+        glm::ivec3 voxel = cell;
+        if (dirMask & 4) voxel.x = dim - 1 - voxel.x;
+        if (dirMask & 2) voxel.y = dim - 1 - voxel.y;
+        if (dirMask & 1) voxel.z = dim - 1 - voxel.z;
+
+        auto i = static_cast<uint>((voxel.x * dim + voxel.y) * dim + voxel.z);
+
+        if ((brick[i >> 5] >> (i & 31)) & 1) {
+            hit->distance = tEntry;
+            hit->normal = glm::vec3(0.0f);
+            hit->normal[axis] = -sign(direction)[axis];
+            hit->paletteIndex = (payload[i >> 2] >> ((i & 3) * 8)) & 0xff;
+            return true;
+        }
+
+        // Advance to the closest cell
+        if (tNext.x < tNext.y && tNext.x < tNext.z) {
+            tEntry = tNext.x; tNext.x += cellT.x; axis = 0;
+            if (++cell.x == dim) return false;
+        } else if (tNext.y < tNext.z) {
+            tEntry = tNext.y; tNext.y += cellT.y; axis = 1;
+            if (++cell.y == dim) return false;
+        } else {
+            tEntry = tNext.z; tNext.z += cellT.z; axis = 2;
+            if (++cell.z == dim) return false;
+        }
+    }
+}
+
+
+bool traceOctree(const Octree& octree, glm::vec3 origin, glm::vec3 direction, RayHit* hit, size_t* steps) {
+    const Node* nodes = octree.getNodeData();
+    const uint* bricks = octree.getBrickData();
+
+    uint dirMask = (direction.x < 0.0f ? 4 : 0) + (direction.y < 0.0f ? 2 : 0) + (direction.z < 0.0f ? 1 : 0);
+
+    glm::vec3 t0, t1;
+    if (!cubeIntersection(float(1u << nodes[0].size), origin, direction, &t0, &t1)) return false;
+    if (t1.x < 0.0f || t1.y < 0.0f || t1.z < 0.0f) return false;
+
+    float t = std::max(0.0f, maxComponent(t0));
+    glm::vec3 tMid = 0.5f * (t0 + t1);
+    uint childIndex = firstChild(t, tMid);
+
+    struct StackEntry {
+        uint index, childIndex;
+        glm::vec3 t0, tMid, t1;
+    };
+
+    StackEntry stack[MAX_STACK_DEPTH];
+    uint stackLen = 0;
+
+    uint index = 0;
+    uint occupied = mirrorMask(nodes[0].mask, dirMask);
+
+    while (true) {
+        if (steps) *steps += 1;
+
+        // Leave the node as soon as none of the children left along the ray are occupied
+        bool nodeEmpty = (occupied & remainingChildren(childIndex)) == 0;
+        bool exitNode = nodeEmpty;
+
+        uint nextChild = childIndex;
+        glm::vec3 t0Child(0.0f), t1Child(0.0f);
+
+        if (!nodeEmpty) {
+            getChildT(childIndex, t0, tMid, t1, &t0Child, &t1Child);
+            nextChild = getNextChild(childIndex, t1Child, &exitNode);
+        }
+
+        if (occupied & (1u << childIndex)) {
+            uint childGlobalIndex = nodes[index].children[childIndex ^ dirMask];
+            const Node& child = nodes[childGlobalIndex];
+
+            if (child.flags & NODE_LEAF) {
+                float tEntry = maxComponent(t0Child);
+                glm::vec3 flip = -sign(direction);
+
+                hit->distance = tEntry;
+                hit->normal = glm::vec3(tEntry == t0Child.x ? flip.x : 0.0f,
+                                        tEntry == t0Child.y ? flip.y : 0.0f,
+                                        tEntry == t0Child.z ? flip.z : 0.0f);
+                hit->paletteIndex = child.children[0];
+                return true;
+            }
+
+            if (child.flags & NODE_BRICK) {
+                if (traceBrick(bricks + child.children[0], child.size, dirMask, t, t0Child, t1Child, direction, hit, steps)) {
+                    return true;
+                }
+            } else {
+                glm::vec3 tMidChild = 0.5f * (t0Child + t1Child);
+                uint firstGrandChild = firstChild(t, tMidChild);
+                uint childOccupied = mirrorMask(child.mask, dirMask);
+
+                // Only descend if the ray can hit anything inside the child
+                if (childOccupied & remainingChildren(firstGrandChild)) {
+                    if (!exitNode) stack[stackLen++] = StackEntry{index, nextChild, t0, tMid, t1};
+
+                    index = childGlobalIndex;
+                    occupied = childOccupied;
+                    t0 = t0Child;
+                    t1 = t1Child;
+                    tMid = tMidChild;
+                    childIndex = firstGrandChild;
+
+                    continue;
+                }
+            }
+        }
+
+        if (exitNode) {
+            if (stackLen == 0) return false;
+
+            const StackEntry& entry = stack[--stackLen];
+            t = minComponent(t1);
+
+            index = entry.index;
+            childIndex = entry.childIndex;
+            t0 = entry.t0;
+            tMid = entry.tMid;
+            t1 = entry.t1;
+
+            occupied = mirrorMask(nodes[index].mask, dirMask);
+            continue;
+        }
+
+        childIndex = nextChild;
+        t = minComponent(t1Child);
+    }
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include "Octree.h"
+
+#include "glm/glm.hpp"
+
+
+/// Where a ray hit a voxel
+struct RayHit {
+    /// The distance along the ray, in units of its direction
+    float distance;
+
+    glm::vec3 normal;
+    uint paletteIndex;
+};
+
+
+/// Find the closest voxel along a ray on the host, visiting the nodes in the same order as the kernel does.
+///
+/// Empty space distances and streamed pages are not supported.
+/// If `steps` is not null it is increased by the number of nodes and brick cells that were stepped through.
+bool traceOctree(const Octree& octree, glm::vec3 origin, glm::vec3 direction, RayHit* hit, size_t* steps = nullptr);
@@ -0,0 +1,156 @@
+#include "TraversalStats.h"
+
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+
+/// The names of the counters in CSV files, in the order they are declared
+const char* COUNTER_NAMES[] = {
+        "rays", "hits", "misses", "steps", "node_fetches", "pushes", "pops", "max_depth", "shadow_rays", "shadow_steps"
+};
+
+
+/// The fewest steps that at least `fraction` of the rays in a histogram took no more than
+static uint stepPercentile(const std::vector<double>& histogram, double fraction) {
+    double total = 0;
+    for (double count : histogram) total += count;
+
+    double seen = 0;
+    for (uint bin = 0; bin < STATS_BINS; ++bin) {
+        seen += histogram[bin];
+        if (seen >= fraction * total) return (bin + 1) * STATS_BIN_WIDTH - 1;
+    }
+
+    return STATS_BINS * STATS_BIN_WIDTH - 1;
+}
+
+
+TraversalStats::TraversalStats(cl_context context, cl_command_queue queue, size_t latency, size_t window) :
+        queue(queue), frameCount(0), window(window) {
+    for (size_t i = 0; i < latency; ++i) {
+        cl_int error;
+        cl_mem buffer = clCreateBuffer(context, CL_MEM_READ_WRITE, (STAT_COUNT + STATS_BINS) * sizeof(cl_uint), nullptr, &error);
+        checkCLError(error);
+
+        this->slots.push_back(Slot{buffer, nullptr, 0, std::vector<cl_uint>(STAT_COUNT + STATS_BINS, 0)});
+    }
+}
+
+TraversalStats::~TraversalStats() {
+    for (Slot& slot : this->slots) {
+        if (slot.event) {
+            clWaitForEvents(1, &slot.event);
+            clReleaseEvent(slot.event);
+        }
+
+        clReleaseMemObject(slot.buffer);
+    }
+}
+
+void TraversalStats::collect(Slot& slot) {
+    FrameStats stats{};
+    stats.frame = slot.frame;
+    std::copy(slot.words.begin(), slot.words.begin() + STAT_COUNT, stats.counters);
+    std::copy(slot.words.begin() + STAT_COUNT, slot.words.end(), stats.histogram);
+
+    this->frames.push_back(stats);
+    if (this->frames.size() > this->window) this->frames.pop_front();
+
+    clReleaseEvent(slot.event);
+    slot.event = nullptr;
+}
+
+void TraversalStats::bind(cl_kernel kernel, cl_uint argument) {
+    Slot& slot = this->slots[this->frameCount % this->slots.size()];
+
+    // The buffer is still being read back from an earlier frame
+    if (slot.event) {
+        cl_int error = clWaitForEvents(1, &slot.event);
+        checkCLError(error);
+
+        this->collect(slot);
+    }
+
+    cl_uint zero = 0;
+    cl_int error = clEnqueueFillBuffer(this->queue, slot.buffer, &zero, sizeof(zero), 0,
+                                       slot.words.size() * sizeof(cl_uint), 0, nullptr, nullptr);
+    checkCLError(error);
+
+    error = clSetKernelArg(kernel, argument, sizeof(slot.buffer), &slot.buffer);
+    checkCLError(error);
+}
+
+void TraversalStats::read() {
+    Slot& slot = this->slots[this->frameCount % this->slots.size()];
+    slot.frame = this->frameCount;
+
+    cl_int error = clEnqueueReadBuffer(this->queue, slot.buffer, CL_FALSE, 0, slot.words.size() * sizeof(cl_uint),
+                                       slot.words.data(), 0, nullptr, &slot.event);
+    checkCLError(error);
+
+    this->frameCount++;
+
+    // Keep every frame that has arrived, oldest first, stopping at the first that hasn't so that frames stay in order
+    for (size_t i = 0; i < this->slots.size(); ++i) {
+        Slot& oldest = this->slots[(this->frameCount + i) % this->slots.size()];
+        if (!oldest.event) continue;
+
+        cl_int status;
+        error = clGetEventInfo(oldest.event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(status), &status, nullptr);
+        checkCLError(error);
+
+        if (status != CL_COMPLETE) break;
+
+        this->collect(oldest);
+    }
+}
+
+void TraversalStats::report(std::ostream& out) const {
+    if (this->frames.empty()) return;
+
+    std::vector<double> totals(STAT_COUNT, 0.0), histogram(STATS_BINS, 0.0);
+    cl_uint maxDepth = 0;
+
+    for (const FrameStats& frame : this->frames) {
+        for (int i = 0; i < STAT_COUNT; ++i) totals[i] += frame.counters[i];
+        for (uint bin = 0; bin < STATS_BINS; ++bin) histogram[bin] += frame.histogram[bin];
+
+        maxDepth = std::max(maxDepth, frame.counters[STAT_MAX_DEPTH]);
+    }
+
+    double rays = std::max(totals[STAT_RAYS], 1.0);
+    double shadowRays = std::max(totals[STAT_SHADOW_RAYS], 1.0);
+
+    out << std::fixed << std::setprecision(2);
+
+    out << "rays: " << totals[STAT_RAYS] / this->frames.size() << " per frame, "
+        << 100.0 * totals[STAT_HITS] / rays << "% hit, "
+        << totals[STAT_STEPS] / rays << " steps (median " << stepPercentile(histogram, 0.5)
+        << ", 99th percentile " << stepPercentile(histogram, 0.99) << "), "
+        << totals[STAT_NODE_FETCHES] / rays << " node fetches, "
+        << totals[STAT_PUSHES] / rays << " pushes and " << totals[STAT_POPS] / rays << " pops per ray, "
+        << "max depth " << maxDepth << "\n";
+
+    out << "shadows: " << totals[STAT_SHADOW_RAYS] / rays << " per ray, "
+        << totals[STAT_SHADOW_STEPS] / shadowRays << " steps per shadow ray\n";
+
+    out << std::defaultfloat << std::setprecision(6);
+}
+
+void TraversalStats::write(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Failed to create file: " + path);
+
+    file << "frame";
+    for (const char* name : COUNTER_NAMES) file << "," << name;
+    for (uint bin = 0; bin < STATS_BINS; ++bin) file << ",steps_" << bin * STATS_BIN_WIDTH;
+    file << "\n";
+
+    for (const FrameStats& frame : this->frames) {
+        file << frame.frame;
+        for (cl_uint counter : frame.counters) file << "," << counter;
+        for (cl_uint count : frame.histogram) file << "," << count;
+        file << "\n";
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <ostream>
+
+#include "OpenCL.h"
+
+
+/// The counters of a kernel built with -DSTATS, in the order they are stored, must match the kernel
+enum TraversalCounter {
+    STAT_RAYS,
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_STEPS,
+    STAT_NODE_FETCHES,
+    STAT_PUSHES,
+    STAT_POPS,
+    STAT_MAX_DEPTH,
+    STAT_SHADOW_RAYS,
+    STAT_SHADOW_STEPS,
+    STAT_COUNT
+};
+
+/// The counters are followed by a histogram of the steps of every primary ray, must match the kernel
+const uint STATS_BINS = 64;
+const uint STATS_BIN_WIDTH = 4;
+
+
+/// The counters and histogram of a single frame
+struct FrameStats {
+    size_t frame;
+    cl_uint counters[STAT_COUNT];
+    cl_uint histogram[STATS_BINS];
+};
+
+
+/// Collects the traversal counters of a kernel built with -DSTATS over the last frames.
+///
+/// Every frame counts into a buffer of its own, which is read back without waiting for it. A buffer is only
+/// reused once its counters have arrived, so the counters of a frame show up a few frames after it was rendered.
+class TraversalStats {
+    cl_command_queue queue;
+
+    /// The buffer every frame in flight counts into, and the counters being read back from it
+    struct Slot {
+        cl_mem buffer;
+        cl_event event;
+        size_t frame;
+        std::vector<cl_uint> words;
+    };
+
+    std::vector<Slot> slots;
+
+    /// The number of frames that have been rendered
+    size_t frameCount;
+
+    /// The number of frames that are kept, and the kept frames, oldest first
+    size_t window;
+    std::deque<FrameStats> frames;
+
+    /// Keep the counters of a slot that has been read back
+    void collect(Slot& slot);
+
+public:
+
+    /// Allow `latency` frames to be in flight before waiting for the oldest of them
+    TraversalStats(cl_context context, cl_command_queue queue, size_t latency = 3, size_t window = 120);
+    ~TraversalStats();
+
+    TraversalStats(const TraversalStats&) = delete;
+    TraversalStats& operator=(const TraversalStats&) = delete;
+
+    /// Clear the buffer of the next frame and bind it to the kernel
+    void bind(cl_kernel kernel, cl_uint argument);
+
+    /// Start reading back the counters of the frame that was just rendered, and keep those that have arrived
+    void read();
+
+    /// Print the average work per ray over the kept frames
+    void report(std::ostream& out) const;
+
+    /// Write the counters and histogram of every kept frame as CSV
+    void write(const std::string& path) const;
+};
@@ -0,0 +1,488 @@
+#include "Vox.h"
+#include "Trace.h"
+
+#include <fstream>
+#include <sstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+
+/// The palette used by files without an RGBA chunk, indexed by palette index
+static const uint DEFAULT_PALETTE[256] = {
+        0x00000000, 0xffffffff, 0xffccffff, 0xff99ffff, 0xff66ffff, 0xff33ffff, 0xff00ffff, 0xffffccff, 0xffccccff, 0xff99ccff, 0xff66ccff, 0xff33ccff, 0xff00ccff, 0xffff99ff, 0xffcc99ff, 0xff9999ff,
+        0xff6699ff, 0xff3399ff, 0xff0099ff, 0xffff66ff, 0xffcc66ff, 0xff9966ff, 0xff6666ff, 0xff3366ff, 0xff0066ff, 0xffff33ff, 0xffcc33ff, 0xff9933ff, 0xff6633ff, 0xff3333ff, 0xff0033ff, 0xffff00ff,
+        0xffcc00ff, 0xff9900ff, 0xff6600ff, 0xff3300ff, 0xff0000ff, 0xffffffcc, 0xffccffcc, 0xff99ffcc, 0xff66ffcc, 0xff33ffcc, 0xff00ffcc, 0xffffcccc, 0xffcccccc, 0xff99cccc, 0xff66cccc, 0xff33cccc,
+        0xff00cccc, 0xffff99cc, 0xffcc99cc, 0xff9999cc, 0xff6699cc, 0xff3399cc, 0xff0099cc, 0xffff66cc, 0xffcc66cc, 0xff9966cc, 0xff6666cc, 0xff3366cc, 0xff0066cc, 0xffff33cc, 0xffcc33cc, 0xff9933cc,
+        0xff6633cc, 0xff3333cc, 0xff0033cc, 0xffff00cc, 0xffcc00cc, 0xff9900cc, 0xff6600cc, 0xff3300cc, 0xff0000cc, 0xffffff99, 0xffccff99, 0xff99ff99, 0xff66ff99, 0xff33ff99, 0xff00ff99, 0xffffcc99,
+        0xffcccc99, 0xff99cc99, 0xff66cc99, 0xff33cc99, 0xff00cc99, 0xffff9999, 0xffcc9999, 0xff999999, 0xff669999, 0xff339999, 0xff009999, 0xffff6699, 0xffcc6699, 0xff996699, 0xff666699, 0xff336699,
+        0xff006699, 0xffff3399, 0xffcc3399, 0xff993399, 0xff663399, 0xff333399, 0xff003399, 0xffff0099, 0xffcc0099, 0xff990099, 0xff660099, 0xff330099, 0xff000099, 0xffffff66, 0xffccff66, 0xff99ff66,
+        0xff66ff66, 0xff33ff66, 0xff00ff66, 0xffffcc66, 0xffcccc66, 0xff99cc66, 0xff66cc66, 0xff33cc66, 0xff00cc66, 0xffff9966, 0xffcc9966, 0xff999966, 0xff669966, 0xff339966, 0xff009966, 0xffff6666,
+        0xffcc6666, 0xff996666, 0xff666666, 0xff336666, 0xff006666, 0xffff3366, 0xffcc3366, 0xff993366, 0xff663366, 0xff333366, 0xff003366, 0xffff0066, 0xffcc0066, 0xff990066, 0xff660066, 0xff330066,
+        0xff000066, 0xffffff33, 0xffccff33, 0xff99ff33, 0xff66ff33, 0xff33ff33, 0xff00ff33, 0xffffcc33, 0xffcccc33, 0xff99cc33, 0xff66cc33, 0xff33cc33, 0xff00cc33, 0xffff9933, 0xffcc9933, 0xff999933,
+        0xff669933, 0xff339933, 0xff009933, 0xffff6633, 0xffcc6633, 0xff996633, 0xff666633, 0xff336633, 0xff006633, 0xffff3333, 0xffcc3333, 0xff993333, 0xff663333, 0xff333333, 0xff003333, 0xffff0033,
+        0xffcc0033, 0xff990033, 0xff660033, 0xff330033, 0xff000033, 0xffffff00, 0xffccff00, 0xff99ff00, 0xff66ff00, 0xff33ff00, 0xff00ff00, 0xffffcc00, 0xffcccc00, 0xff99cc00, 0xff66cc00, 0xff33cc00,
+        0xff00cc00, 0xffff9900, 0xffcc9900, 0xff999900, 0xff669900, 0xff339900, 0xff009900, 0xffff6600, 0xffcc6600, 0xff996600, 0xff666600, 0xff336600, 0xff006600, 0xffff3300, 0xffcc3300, 0xff993300,
+        0xff663300, 0xff333300, 0xff003300, 0xffff0000, 0xffcc0000, 0xff990000, 0xff660000, 0xff330000, 0xff0000ee, 0xff0000dd, 0xff0000bb, 0xff0000aa, 0xff000088, 0xff000077, 0xff000055, 0xff000044,
+        0xff000022, 0xff000011, 0xff00ee00, 0xff00dd00, 0xff00bb00, 0xff00aa00, 0xff008800, 0xff007700, 0xff005500, 0xff004400, 0xff002200, 0xff001100, 0xffee0000, 0xffdd0000, 0xffbb0000, 0xffaa0000,
+        0xff880000, 0xff770000, 0xff550000, 0xff440000, 0xff220000, 0xff110000, 0xffeeeeee, 0xffdddddd, 0xffbbbbbb, 0xffaaaaaa, 0xff888888, 0xff777777, 0xff555555, 0xff444444, 0xff222222, 0xff111111
+};
+
+
+/// Read a number from a dictionary, or use a default if it is missing
+static float dictFloat(const std::map<std::string, std::string>& dict, const std::string& key, float fallback) {
+    auto found = dict.find(key);
+    return found == dict.end() ? fallback : std::stof(found->second);
+}
+
+
+/// Scene graphs deeper than this are assumed to contain a cycle
+const int MAX_SCENE_DEPTH = 64;
+
+
+/// Reads little endian values from a range of bytes
+struct VoxReader {
+    const char* data;
+    size_t position, end;
+
+    void require(size_t count) {
+        if (position + count > end) throw std::runtime_error("Unexpected end of .vox chunk");
+    }
+
+    int readInt() {
+        require(4);
+        int value;
+        std::memcpy(&value, data + position, 4);
+        position += 4;
+        return value;
+    }
+
+    std::string readString() {
+        int length = readInt();
+        if (length < 0) throw std::runtime_error("Invalid string in .vox file");
+
+        require(static_cast<size_t>(length));
+        std::string value(data + position, static_cast<size_t>(length));
+        position += length;
+        return value;
+    }
+
+    std::map<std::string, std::string> readDict() {
+        std::map<std::string, std::string> dict;
+
+        int count = readInt();
+        for (int i = 0; i < count; ++i) {
+            std::string key = readString();
+            dict[key] = readString();
+        }
+
+        return dict;
+    }
+};
+
+
+/// A node in the scene graph
+struct SceneNode {
+    enum Type { TRANSFORM, GROUP, SHAPE } type;
+
+    /// The children of a transform or group
+    std::vector<int> children;
+
+    /// The transform of a transform node
+    int rotation[3][3];
+    int translation[3];
+
+    /// The models of a shape
+    std::vector<int> models;
+};
+
+
+static void setIdentity(int rotation[3][3]) {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 3; ++j) {
+            rotation[i][j] = i == j ? 1 : 0;
+        }
+    }
+}
+
+
+/// Decode a rotation stored as a byte: bits 0-1 and 2-3 give the column of the non-zero entry
+/// in the first and second row, and bits 4-6 tell if the entries of each row are negative
+static void decodeRotation(int bits, int rotation[3][3]) {
+    int first = bits & 3;
+    int second = (bits >> 2) & 3;
+
+    if (first > 2 || second > 2 || first == second) {
+        setIdentity(rotation);
+        return;
+    }
+
+    int columns[3] = {first, second, 3 - first - second};
+
+    for (int row = 0; row < 3; ++row) {
+        for (int column = 0; column < 3; ++column) rotation[row][column] = 0;
+        rotation[row][columns[row]] = (bits & (16 << row)) ? -1 : 1;
+    }
+}
+
+
+VoxFile readVox(const std::string& path) {
+    TraceSpan span("readVox");
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open file!" + path);
+    }
+
+    std::vector<char> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    VoxReader reader{bytes.data(), 0, bytes.size()};
+
+    reader.require(8);
+    if (std::strncmp(bytes.data(), "VOX ", 4) != 0) {
+        throw std::runtime_error("Not a MagicaVoxel file: " + path);
+    }
+    reader.position = 8;
+
+    // All other chunks are children of the main chunk
+    reader.require(12);
+    if (std::strncmp(bytes.data() + reader.position, "MAIN", 4) != 0) {
+        throw std::runtime_error("Missing MAIN chunk: " + path);
+    }
+    reader.position += 4;
+    int mainContent = reader.readInt();
+    reader.readInt();
+    reader.position += mainContent;
+
+    VoxFile vox;
+    std::copy(DEFAULT_PALETTE, DEFAULT_PALETTE + 256, vox.palette);
+    std::fill(vox.materials, vox.materials + 256, VoxMaterial{0.0f, 0.0f, 0.0f});
+
+    std::map<int, SceneNode> scene;
+
+    while (reader.position + 12 <= reader.end) {
+        std::string id(bytes.data() + reader.position, 4);
+        reader.position += 4;
+
+        int contentSize = reader.readInt();
+        int childrenSize = reader.readInt();
+        reader.require(static_cast<size_t>(contentSize));
+
+        VoxReader chunk{bytes.data(), reader.position, reader.position + contentSize};
+
+        if (id == "SIZE") {
+            VoxModel model;
+            model.sizeX = chunk.readInt();
+            model.sizeY = chunk.readInt();
+            model.sizeZ = chunk.readInt();
+            vox.models.push_back(model);
+        } else if (id == "XYZI") {
+            if (vox.models.empty()) throw std::runtime_error("XYZI chunk without a SIZE chunk: " + path);
+
+            int count = chunk.readInt();
+            chunk.require(4 * static_cast<size_t>(count));
+
+            std::vector<VoxVoxel>& voxels = vox.models.back().voxels;
+            voxels.resize(static_cast<size_t>(count));
+            std::memcpy(voxels.data(), bytes.data() + chunk.position, 4 * static_cast<size_t>(count));
+        } else if (id == "RGBA") {
+            // Colors 0-254 are used by palette indices 1-255
+            chunk.require(4 * 255);
+            std::memcpy(vox.palette + 1, bytes.data() + chunk.position, 4 * 255);
+        } else if (id == "MATL") {
+            // Materials of newer files, stored as a dictionary with the type and its parameters
+            int index = chunk.readInt();
+            std::map<std::string, std::string> properties = chunk.readDict();
+
+            if (0 < index && index < 256) {
+                VoxMaterial& material = vox.materials[index];
+                std::string type = properties.count("_type") ? properties["_type"] : "_diffuse";
+                float weight = dictFloat(properties, "_weight", 1.0f);
+
+                if (type == "_metal") material.metal = dictFloat(properties, "_metal", weight);
+                if (type == "_glass") material.glass = dictFloat(properties, "_trans", weight);
+                if (type == "_emit") material.emission = dictFloat(properties, "_emit", weight);
+            }
+        } else if (id == "MATT") {
+            // Materials of older files: the type followed by its weight
+            int index = chunk.readInt();
+            int type = chunk.readInt();
+            float weight;
+            chunk.require(4);
+            std::memcpy(&weight, bytes.data() + chunk.position, 4);
+
+            if (0 < index && index < 256) {
+                VoxMaterial& material = vox.materials[index];
+                if (type == 1) material.metal = weight;
+                if (type == 2) material.glass = weight;
+                if (type == 3) material.emission = weight;
+            }
+        } else if (id == "nTRN") {
+            int nodeId = chunk.readInt();
+            chunk.readDict();
+
+            SceneNode& node = scene[nodeId];
+            node.type = SceneNode::TRANSFORM;
+            node.children.push_back(chunk.readInt());
+
+            // Reserved id and layer
+            chunk.readInt();
+            chunk.readInt();
+
+            setIdentity(node.rotation);
+            std::fill(node.translation, node.translation + 3, 0);
+
+            // Only the first frame is used
+            int frameCount = chunk.readInt();
+            if (frameCount > 0) {
+                std::map<std::string, std::string> frame = chunk.readDict();
+
+                if (frame.count("_r")) decodeRotation(std::stoi(frame["_r"]), node.rotation);
+
+                if (frame.count("_t")) {
+                    std::istringstream ss(frame["_t"]);
+                    ss >> node.translation[0] >> node.translation[1] >> node.translation[2];
+                }
+            }
+        } else if (id == "nGRP") {
+            int nodeId = chunk.readInt();
+            chunk.readDict();
+
+            SceneNode& node = scene[nodeId];
+            node.type = SceneNode::GROUP;
+
+            int childCount = chunk.readInt();
+            for (int i = 0; i < childCount; ++i) {
+                node.children.push_back(chunk.readInt());
+            }
+        } else if (id == "nSHP") {
+            int nodeId = chunk.readInt();
+            chunk.readDict();
+
+            SceneNode& node = scene[nodeId];
+            node.type = SceneNode::SHAPE;
+
+            int modelCount = chunk.readInt();
+            for (int i = 0; i < modelCount; ++i) {
+                node.models.push_back(chunk.readInt());
+                chunk.readDict();
+            }
+        }
+
+        // Unknown chunks (PACK, LAYR, rOBJ, ...) are skipped
+        reader.position += contentSize;
+        reader.position += childrenSize;
+    }
+
+    if (scene.count(0) == 0) {
+        // Without a scene graph every model is placed with its corner at the origin
+        for (uint i = 0; i < vox.models.size(); ++i) {
+            VoxInstance instance{};
+            instance.model = i;
+            setIdentity(instance.rotation);
+            instance.translation[0] = vox.models[i].sizeX / 2;
+            instance.translation[1] = vox.models[i].sizeY / 2;
+            instance.translation[2] = vox.models[i].sizeZ / 2;
+            vox.instances.push_back(instance);
+        }
+
+        return vox;
+    }
+
+    // Walk the scene graph from the root and accumulate the transforms down to each shape
+    struct Visit {
+        int node, depth;
+        int rotation[3][3];
+        int translation[3];
+    };
+
+    Visit root{0, 0, {}, {0, 0, 0}};
+    setIdentity(root.rotation);
+    std::vector<Visit> stack = {root};
+
+    while (!stack.empty()) {
+        Visit visit = stack.back();
+        stack.pop_back();
+
+        auto found = scene.find(visit.node);
+        if (found == scene.end()) continue;
+
+        if (visit.depth > MAX_SCENE_DEPTH) {
+            throw std::runtime_error("The scene graph is too deep: " + path);
+        }
+
+        const SceneNode& node = found->second;
+
+        if (node.type == SceneNode::SHAPE) {
+            for (int model : node.models) {
+                if (model < 0 || static_cast<size_t>(model) >= vox.models.size()) continue;
+
+                VoxInstance instance{};
+                instance.model = static_cast<uint>(model);
+                std::memcpy(instance.rotation, visit.rotation, sizeof(instance.rotation));
+                std::memcpy(instance.translation, visit.translation, sizeof(instance.translation));
+                vox.instances.push_back(instance);
+            }
+
+            continue;
+        }
+
+        Visit child = visit;
+        child.depth++;
+
+        if (node.type == SceneNode::TRANSFORM) {
+            // Apply the node's transform before the ones above it
+            for (int i = 0; i < 3; ++i) {
+                child.translation[i] = visit.translation[i];
+
+                for (int j = 0; j < 3; ++j) {
+                    child.translation[i] += visit.rotation[i][j] * node.translation[j];
+
+                    child.rotation[i][j] = 0;
+                    for (int k = 0; k < 3; ++k) {
+                        child.rotation[i][j] += visit.rotation[i][k] * node.rotation[k][j];
+                    }
+                }
+            }
+        }
+
+        for (int next : node.children) {
+            child.node = next;
+            stack.push_back(child);
+        }
+    }
+
+    return vox;
+}
+
+
+/// Insert all voxels of an instance into an octree
+static void insertInstance(Octree& octree, const VoxFile& file, const VoxInstance& instance) {
+    const VoxModel& model = file.models[instance.model];
+    int half[3] = {model.sizeX / 2, model.sizeY / 2, model.sizeZ / 2};
+
+    octree.reserve(model.voxels.size(), std::max(model.sizeX, std::max(model.sizeY, model.sizeZ)));
+
+    for (const VoxVoxel& voxel : model.voxels) {
+        int local[3] = {voxel.x - half[0], voxel.y - half[1], voxel.z - half[2]};
+        int world[3];
+
+        for (int i = 0; i < 3; ++i) {
+            world[i] = instance.translation[i];
+            for (int j = 0; j < 3; ++j) world[i] += instance.rotation[i][j] * local[j];
+        }
+
+        octree.setVoxel(world[0], world[2], world[1], voxel.index);
+    }
+}
+
+
+Octree buildVoxOctree(const VoxFile& file, uchar brickLevel) {
+    TraceSpan span("buildVoxOctree");
+    size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+    workerCount = std::max<size_t>(1, std::min(workerCount, file.instances.size()));
+
+    // Every worker builds its own octree from the instances it takes, since they all
+    // share the same origin they can be merged without moving any voxels
+    std::vector<Octree> octrees(workerCount, Octree(4, brickLevel));
+    std::atomic<size_t> next(0);
+
+    auto work = [&](size_t worker) {
+        TraceSpan workerSpan("insertInstances");
+        for (size_t i = next++; i < file.instances.size(); i = next++) {
+            insertInstance(octrees[worker], file, file.instances[i]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t worker = 1; worker < workerCount; ++worker) {
+        threads.emplace_back(work, worker);
+    }
+
+    work(0);
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    {
+        TraceSpan mergeSpan("merge");
+        for (size_t worker = 1; worker < workerCount; ++worker) {
+            octrees[0].merge(octrees[worker]);
+        }
+    }
+
+    octrees[0].collapse();
+
+    return std::move(octrees[0]);
+}
+
+
+Octree buildVoxTile(const VoxFile& file, const int offset[3], uchar brickLevel) {
+    TraceSpan span("buildVoxTile");
+    Octree octree(4, brickLevel);
+
+    for (VoxInstance instance : file.instances) {
+        for (int i = 0; i < 3; ++i) instance.translation[i] += offset[i];
+        insertInstance(octree, file, instance);
+    }
+
+    return octree;
+}
+
+
+Octree buildVoxModel(const VoxFile& file, uint model, uchar brickLevel) {
+    VoxInstance instance{};
+    instance.model = model;
+    setIdentity(instance.rotation);
+
+    Octree octree(4, brickLevel);
+    insertInstance(octree, file, instance);
+    octree.collapse();
+    return octree;
+}
+
+
+std::vector<Octree> buildVoxAnimation(const VoxFile& file, uchar brickLevel) {
+    std::vector<Octree> frames;
+
+    for (uint model = 0; model < file.models.size(); ++model) {
+        frames.push_back(buildVoxModel(file, model, brickLevel));
+    }
+
+    return frames;
+}
+
+
+void remapVoxPalette(VoxFile& file, const uint palette[256], const VoxMaterial materials[256]) {
+    // Squared distance between two colors, ignoring alpha
+    auto difference = [](uint a, uint b) {
+        int sum = 0;
+        for (int shift = 0; shift < 24; shift += 8) {
+            int d = int((a >> shift) & 0xff) - int((b >> shift) & 0xff);
+            sum += d * d;
+        }
+        return sum;
+    };
+
+    uchar mapping[256] = {0};
+    for (int i = 1; i < 256; ++i) {
+        int best = 1;
+        for (int j = 2; j < 256; ++j) {
+            if (difference(file.palette[i], palette[j]) < difference(file.palette[i], palette[best])) best = j;
+        }
+        mapping[i] = static_cast<uchar>(best);
+    }
+
+    for (VoxModel& model : file.models) {
+        for (VoxVoxel& voxel : model.voxels) {
+            voxel.index = mapping[voxel.index];
+        }
+    }
+
+    std::copy(palette, palette + 256, file.palette);
+    std::copy(materials, materials + 256, file.materials);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Octree.h"
+
+
+/// A single voxel in a MagicaVoxel model
+struct VoxVoxel {
+    uchar x, y, z, index;
+};
+
+
+/// A model as stored in a SIZE and XYZI chunk pair
+struct VoxModel {
+    int sizeX, sizeY, sizeZ;
+    std::vector<VoxVoxel> voxels;
+};
+
+
+/// A model placed in the world by the scene graph.
+///
+/// A voxel `v` of the model ends up at `rotation * (v - size / 2) + translation`,
+/// where every row of `rotation` has a single non-zero entry of either 1 or -1.
+struct VoxInstance {
+    uint model;
+    int rotation[3][3];
+    int translation[3];
+};
+
+
+/// The material of a palette index, every weight is between 0 and 1
+struct VoxMaterial {
+    float metal, glass, emission;
+};
+
+
+/// The contents of a MagicaVoxel file
+struct VoxFile {
+    std::vector<VoxModel> models;
+    std::vector<VoxInstance> instances;
+
+    /// The RGBA color of every palette index, where index 0 is empty
+    uint palette[256];
+
+    /// The material of every palette index, from MATL or MATT chunks, diffuse if absent
+    VoxMaterial materials[256];
+};
+
+
+/// Read a MagicaVoxel file, including its scene graph (nTRN, nGRP and nSHP chunks) and materials.
+///
+/// Files without a scene graph get one instance per model, with the model's corner at the origin.
+VoxFile readVox(const std::string& path);
+
+/// Build a single octree of every instance in a file.
+///
+/// Instances are inserted in parallel into separate octrees, which are then merged.
+/// The file's z-axis points up, so it becomes the octree's y-axis.
+Octree buildVoxOctree(const VoxFile& file, uchar brickLevel);
+
+/// Build a single octree of every instance in a file moved by an offset, on the calling thread
+Octree buildVoxTile(const VoxFile& file, const int offset[3], uchar brickLevel);
+
+/// Build an octree of a single model, centered on the origin with the y-axis pointing up
+Octree buildVoxModel(const VoxFile& file, uint model, uchar brickLevel);
+
+/// Build an octree of every model in a file, as used by animations that store one frame per model
+std::vector<Octree> buildVoxAnimation(const VoxFile& file, uchar brickLevel);
+
+/// Change the palette of a file, replacing the palette index of every voxel with the closest color in the new palette.
+/// The materials are replaced as well
+void remapVoxPalette(VoxFile& file, const uint palette[256], const VoxMaterial materials[256]);
@@ -0,0 +1,208 @@
+#include "World.h"
+#include "Log.h"
+#include "Trace.h"
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <exception>
+
+#include <sys/stat.h>
+
+
+const uint TILE_CACHE_VERSION = 1;
+
+
+/// The start of a cached tile, followed by its nodes and bricks
+struct TileCacheHeader {
+    char magic[4];
+    uint version;
+
+    /// Everything the tile was built from, the tile is built again if any of it changes
+    uint brickLevel;
+    int offset[3];
+    uint64_t sourceTime, sourceSize, paletteHash;
+
+    uint64_t nodeCount, brickWordCount;
+};
+
+
+std::vector<WorldTile> readWorldManifest(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Failed to open file: " + path);
+
+    // Tiles are found relative to the manifest
+    size_t slash = path.find_last_of('/');
+    std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    std::vector<WorldTile> tiles;
+    std::string line;
+    int lineNumber = 0;
+
+    while (std::getline(file, line)) {
+        lineNumber++;
+
+        std::istringstream stream(line);
+        std::string name;
+        if (!(stream >> name) || name[0] == '#') continue;
+
+        WorldTile tile{};
+        tile.path = directory + name;
+
+        if (!(stream >> tile.offset[0] >> tile.offset[1] >> tile.offset[2])) {
+            throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": Expected a path followed by an offset");
+        }
+
+        tiles.push_back(tile);
+    }
+
+    if (tiles.empty()) throw std::runtime_error("The world has no tiles: " + path);
+
+    return tiles;
+}
+
+
+/// Load a tile from the cache, or build it from its source file and cache it
+static Octree loadTile(const WorldTile& tile, uchar brickLevel, const std::string& cacheDirectory,
+                       const uint palette[256], const VoxMaterial materials[256], uint64_t paletteHash) {
+    TraceSpan span("loadTile");
+
+    struct stat source{};
+    if (stat(tile.path.c_str(), &source) != 0) throw std::runtime_error("Failed to open file: " + tile.path);
+
+    TileCacheHeader expected{};
+    std::memcpy(expected.magic, "TILE", 4);
+    expected.version = TILE_CACHE_VERSION;
+    expected.brickLevel = brickLevel;
+    std::copy(tile.offset, tile.offset + 3, expected.offset);
+    expected.sourceTime = static_cast<uint64_t>(source.st_mtime);
+    expected.sourceSize = static_cast<uint64_t>(source.st_size);
+    expected.paletteHash = paletteHash;
+
+    // The same file may be placed more than once
+    std::ostringstream key;
+    key << tile.path << " " << tile.offset[0] << " " << tile.offset[1] << " " << tile.offset[2];
+
+    std::ostringstream name;
+    name << cacheDirectory << "/" << std::hex << std::hash<std::string>()(key.str()) << ".tile";
+    std::string cachePath = name.str();
+
+    std::ifstream cache(cachePath, std::ios::binary);
+    TileCacheHeader header{};
+
+    if (cache.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+        std::memcmp(header.magic, expected.magic, 4) == 0 && header.version == expected.version &&
+        header.brickLevel == expected.brickLevel && std::equal(header.offset, header.offset + 3, expected.offset) &&
+        header.sourceTime == expected.sourceTime && header.sourceSize == expected.sourceSize &&
+        header.paletteHash == expected.paletteHash && header.nodeCount > 0) {
+
+        std::vector<Node> nodes(header.nodeCount, Node(0));
+        std::vector<uint> bricks(header.brickWordCount);
+
+        cache.read(reinterpret_cast<char*>(nodes.data()), nodes.size() * sizeof(Node));
+        cache.read(reinterpret_cast<char*>(bricks.data()), bricks.size() * sizeof(uint));
+
+        if (cache) {
+            LOG(DEBUG) << "Loaded " << tile.path << " from " << cachePath;
+            return Octree(std::move(nodes), std::move(bricks), brickLevel);
+        }
+    }
+
+    VoxFile file = readVox(tile.path);
+    if (!std::equal(palette, palette + 256, file.palette)) remapVoxPalette(file, palette, materials);
+
+    Octree octree = buildVoxTile(file, tile.offset, brickLevel);
+    octree.collapse();
+
+    expected.nodeCount = octree.getNodeCount();
+    expected.brickWordCount = octree.getBrickWordCount();
+
+    // A tile that can't be cached is simply built again next time
+    std::ofstream output(cachePath, std::ios::binary);
+    output.write(reinterpret_cast<const char*>(&expected), sizeof(expected));
+    output.write(reinterpret_cast<const char*>(octree.getNodeData()), octree.getNodeCount() * sizeof(Node));
+    output.write(reinterpret_cast<const char*>(octree.getBrickData()), octree.getBrickWordCount() * sizeof(uint));
+
+    if (!output) LOG(WARNING) << "Failed to cache " << tile.path << " in " << cachePath;
+
+    return octree;
+}
+
+
+/// Run `work(i)` for every i below `count`, spread over as many threads as there are cores
+template <typename Work>
+static void parallelFor(size_t count, Work work) {
+    size_t workerCount = std::max(1u, std::thread::hardware_concurrency());
+    workerCount = std::max<size_t>(1, std::min(workerCount, count));
+
+    std::atomic<size_t> next(0);
+    std::vector<std::exception_ptr> errors(workerCount);
+
+    auto worker = [&](size_t index) {
+        try {
+            for (size_t i = next++; i < count; i = next++) work(i);
+        } catch (...) {
+            errors[index] = std::current_exception();
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t index = 1; index < workerCount; ++index) {
+        threads.emplace_back(worker, index);
+    }
+
+    worker(0);
+
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+
+    for (std::exception_ptr& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+}
+
+
+Octree buildWorld(const std::vector<WorldTile>& tiles, uchar brickLevel, const std::string& cacheDirectory,
+                  uint palette[256], VoxMaterial materials[256]) {
+    TraceSpan span("buildWorld");
+
+    // The first tile's file is always read for its palette, which decides the palette indices of every tile
+    VoxFile first = readVox(tiles[0].path);
+    std::copy(first.palette, first.palette + 256, palette);
+    std::copy(first.materials, first.materials + 256, materials);
+
+    std::string colors(reinterpret_cast<const char*>(palette), 256 * sizeof(uint));
+    colors.append(reinterpret_cast<const char*>(materials), 256 * sizeof(VoxMaterial));
+    uint64_t paletteHash = std::hash<std::string>()(colors);
+
+    mkdir(cacheDirectory.c_str(), 0755);
+
+    std::vector<Octree> octrees(tiles.size(), Octree(4, brickLevel));
+
+    parallelFor(tiles.size(), [&](size_t i) {
+        octrees[i] = loadTile(tiles[i], brickLevel, cacheDirectory, palette, materials, paletteHash);
+    });
+
+    // Merge pairs of octrees in parallel until a single one is left, keeping later tiles on top of earlier ones
+    for (size_t step = 1; step < octrees.size(); step *= 2) {
+        size_t pairs = (octrees.size() - step + 2 * step - 1) / (2 * step);
+
+        parallelFor(pairs, [&](size_t pair) {
+            size_t target = 2 * step * pair;
+            octrees[target].merge(octrees[target + step]);
+            octrees[target + step] = Octree(4, brickLevel);
+        });
+    }
+
+    LOG(INFO) << "Built " << tiles.size() << " tile(s)";
+
+    octrees[0].collapse();
+    return std::move(octrees[0]);
+}
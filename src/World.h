@@ -0,0 +1,36 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "Octree.h"
+#include "Vox.h"
+
+
+/// A .vox file placed in a larger world
+struct WorldTile {
+    std::string path;
+
+    /// Added to the translation of every instance in the file, with the z-axis pointing up as in the file
+    int offset[3];
+};
+
+
+/// Read the tiles of a world manifest.
+///
+/// Every line holds the path of a .vox file, relative to the manifest, followed by its offset:
+///
+///     # The first tile's palette is used for every tile
+///     monu1.vox     0 0 0
+///     monu2.vox   128 0 0
+///
+/// Empty lines and lines starting with '#' are ignored.
+std::vector<WorldTile> readWorldManifest(const std::string& path);
+
+
+/// Build every tile on a thread of its own and merge them into a single octree, later tiles overwriting earlier ones.
+///
+/// Every tile is recolored with the palette and materials of the first tile, which are returned as well.
+/// Built tiles are cached in `cacheDirectory`, and only built again when their source file, offset or palette changes.
+Octree buildWorld(const std::vector<WorldTile>& tiles, uchar brickLevel, const std::string& cacheDirectory,
+                  uint palette[256], VoxMaterial materials[256]);
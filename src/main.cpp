@@ -3,10 +3,23 @@
 #include <iterator>
 #include <fstream>
 #include <chrono>
+#include <algorithm>
+#include <memory>
+#include <map>
 
 
 #include "OpenCL.h"
 #include "Octree.h"
+#include "DeviceBuffer.h"
+#include "Vox.h"
+#include "Scene.h"
+#include "Svo.h"
+#include "PageStreamer.h"
+#include "World.h"
+#include "Profiler.h"
+#include "Trace.h"
+#include "TraversalStats.h"
+#include "KernelVariants.h"
 
 #include "lodepng/lodepng.h"
 
@@ -36,7 +49,7 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
     cl_uint platformCount;
     clGetPlatformIDs(0, nullptr, &platformCount);
 
-    Log().get(INFO) << "Found " << platformCount << " platform(s)";
+    LOG(INFO) << "Found " << platformCount << " platform(s)";
 
     std::vector<cl_platform_id> platforms(platformCount);
     clGetPlatformIDs(platformCount, platforms.data(), nullptr);
@@ -44,6 +57,16 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
     // Use the first platform that supports a GPU
     for (auto platform : platforms) {
 
+        // Without a window any device will do
+        if (!window) {
+            cl_uint deviceCount = 0;
+            clGetDeviceIDs(platform, type, 1, device_id, &deviceCount);
+            if (deviceCount == 0) continue;
+
+            *platform_id = platform;
+            return;
+        }
+
         // Create context
         const cl_context_properties contextProperties[] = {
                 CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(glfwGetGLXContext(window)),
@@ -82,7 +105,7 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
             clGetPlatformInfo(platform, CL_PLATFORM_VENDOR, vendorLength, &vendorName[0], nullptr);
             vendorName.pop_back();
 
-            Log().get(INFO) << "Platform (" << vendorName << ") has " << deviceCount << " device(s)";
+            LOG(INFO) << "Platform (" << vendorName << ") has " << deviceCount << " device(s)";
         }
 
         // Try the next platform if no GPU was found
@@ -109,7 +132,7 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
             clGetDeviceInfo(*device_id, CL_DEVICE_NAME, deviceNameLength, &deviceName[0], nullptr);
             deviceName.pop_back();
 
-            Log().get(INFO) << "Using device '" << deviceName << "'";
+            LOG(INFO) << "Using device '" << deviceName << "'";
 
 
 
@@ -120,7 +143,7 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
             extensions.resize(extensionLength);
             clGetDeviceInfo(*device_id, CL_DEVICE_EXTENSIONS, extensionLength, &extensions[0], nullptr);
 
-            Log().get(INFO) << "Available extensions: " << extensions;
+            LOG(INFO) << "Available extensions: " << extensions;
         }*/
 
         return;
@@ -128,74 +151,31 @@ void findDevicePlatform(cl_device_type type, GLFWwindow *window, cl_platform_id
 }
 
 
-/// Load a file from disk and store it as a string
-std::string getKernelSource(std::string path) {
-    std::ifstream file(path);
-
-
-    if (file.is_open()) {
-        return std::string(
-                (std::istreambuf_iterator<char>(file)),
-                std::istreambuf_iterator<char>()
-        );
-    } else {
-        throw std::runtime_error("Failed to open file");
-    }
-}
-
-
-/// Create a context, program and queue
-void createProQue(cl_device_id device, cl_platform_id platform, GLFWwindow *window, cl_context *context,
-                  cl_command_queue *queue, cl_program *program, const char *path) {
-    // Create context
+/// Create a context and queue
+void createContextQueue(cl_device_id device, cl_platform_id platform, GLFWwindow *window, cl_context *context,
+                        cl_command_queue *queue) {
+    // Create context, shared with OpenGL if there is a window
     const cl_context_properties contextProperties[] = {
-            CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(glfwGetGLXContext(window)),
-            CL_GLX_DISPLAY_KHR, reinterpret_cast<cl_context_properties>(glfwGetX11Display()),
+            CL_GL_CONTEXT_KHR, reinterpret_cast<cl_context_properties>(window ? glfwGetGLXContext(window) : nullptr),
+            CL_GLX_DISPLAY_KHR, reinterpret_cast<cl_context_properties>(window ? glfwGetX11Display() : nullptr),
             CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform),
             0, 0
     };
 
 
-    Log().get(INFO) << "Creating context...";
+    LOG(INFO) << "Creating context...";
     cl_int error;
-    *context = clCreateContext(contextProperties, 1, &device, nullptr, nullptr, &error);
-    checkCLError(error);
-    Log().get(INFO) << "Context created!";
-
-
-    // Create a command queue
-    Log().get(INFO) << "Creating queue...";
-    *queue = clCreateCommandQueueWithProperties(*context, device, nullptr, &error);
-    Log().get(INFO) << "Queue created!";
-
-
-    // Create a program
-    Log().get(INFO) << "Creating program...";
-    std::string source = getKernelSource("./kernel/ray_trace.cl");
-    source.append("\0");
-    const char *sources = &source[0];
-    *program = clCreateProgramWithSource(*context, 1, &sources, nullptr, &error);
+    *context = clCreateContext(contextProperties + (window ? 0 : 4), 1, &device, nullptr, nullptr, &error);
     checkCLError(error);
-    Log().get(INFO) << "Program created!";
-
+    LOG(INFO) << "Context created!";
 
-    // Build program
-    Log().get(INFO) << "Building program...";
-    error = clBuildProgram(*program, 1, &device, nullptr, nullptr, nullptr);
-
-    if (error == CL_BUILD_PROGRAM_FAILURE) {
-        size_t length;
-        clGetProgramBuildInfo(*program, device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &length);
-
-        auto *log = new char[length + 1];
-        log[length] = '\0';
-        clGetProgramBuildInfo(*program, device, CL_PROGRAM_BUILD_LOG, length, log, nullptr);
-
-        Log().get(ERROR) << log;
-    }
 
+    // Create a command queue, with timestamps for every command
+    LOG(INFO) << "Creating queue...";
+    const cl_queue_properties queueProperties[] = {CL_QUEUE_PROPERTIES, CL_QUEUE_PROFILING_ENABLE, 0};
+    *queue = clCreateCommandQueueWithProperties(*context, device, queueProperties, &error);
     checkCLError(error);
-    Log().get(INFO) << "Program built!";
+    LOG(INFO) << "Queue created!";
 }
 
 
@@ -237,138 +217,311 @@ GLFWwindow* createWindow(int width, int height, GLFWmonitor* monitor) {
 }
 
 
-#include <sstream>
+/// Create a read only buffer holding a copy of some data.
+/// OpenCL does not allow empty buffers, so those get a single uninitialized word
+cl_mem createBuffer(cl_context context, const void* data, size_t bytes) {
+    cl_int error;
+    cl_mem buffer;
 
-Octree loadVox(std::string path) {
-    std::ifstream file(path, std::ios::binary);
+    if (bytes > 0) {
+        buffer = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, bytes, const_cast<void*>(data), &error);
+    } else {
+        buffer = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(uint), nullptr, &error);
+    }
 
-    if (!file.is_open()) {
-        throw std::runtime_error("Failed to open file!" + path);
+    checkCLError(error);
+    return buffer;
+}
+
+
+/// The number of ways a palette can be recolored
+const int PALETTE_MODES = 3;
+
+/// Recolor a palette: mode 0 keeps the original colors, 1 makes them gray and 2 inverts them
+std::vector<uint> recolorPalette(const std::vector<uint>& colors, int mode) {
+    std::vector<uint> recolored(colors);
+
+    for (uint& color : recolored) {
+        uint r = color & 0xff, g = (color >> 8) & 0xff, b = (color >> 16) & 0xff;
+
+        if (mode == 1) {
+            r = g = b = (r * 77 + g * 150 + b * 29) >> 8;
+        } else if (mode == 2) {
+            r = 255 - r; g = 255 - g; b = 255 - b;
+        }
+
+        color = (color & 0xff000000) | (b << 16) | (g << 8) | r;
     }
 
-    /*size_t size = static_cast<size_t>(file.tellg());
-    file.seekg(0);
+    return recolored;
+}
 
-    char* bytes = new char[size + 1];
-    bytes[size] = '\0';
 
-    file.read(bytes, size);*/
+/// The logarithmic size of the dense bricks at the bottom of the octree (0 to disable bricks)
+const uchar BRICK_LEVEL = 3;
 
-    std::stringstream ss;
-    ss << file.rdbuf();
+/// Let rays jump over empty space using the distances to the closest occupied node
+const bool EMPTY_SPACE_SKIPPING = true;
 
-    // Parse
-    Octree octree = Octree(4);
+/// Seconds to wait after the last edit before computing new distances
+const float DISTANCE_UPDATE_DELAY = 1.0f;
 
-    char magic[4];
-    ss.read(magic, 4);
+/// How far in front of the camera voxels are edited, and how large the edits are
+const float EDIT_REACH = 20.0f;
+const int DIG_RADIUS = 15;
+const int BUILD_RADIUS = 4;
+const uchar BUILD_COLOR = 1;
 
-    int version;
-    ss.read(reinterpret_cast<char *>(&version), sizeof(int));
+/// A crowd of instances sharing a single model, placed in a grid in front of the world with `--crowd <model>`
+const int CROWD_SIZE = 32;
+const int CROWD_SPACING = 24;
 
-    assert(magic[0] == 'V' || magic[1] == 'O' || magic[2] == 'X' || magic[3] == ' ' || version == 150);
+/// A herd of animated instances next to the world with `--herd <model>`, every frame of the animation is uploaded once
+const int HERD_SIZE = 8;
+const int HERD_SPACING = 40;
+const float ANIMATION_FPS = 8.0f;
 
+/// The order the nodes of the world are stored in, can be changed with `--order dfs|bfs|siblings|veb`
+const NodeOrder NODE_ORDER = SIBLING_ORDER;
 
-    struct Chunk {
-        char name[4];
-        int content, children;
-    };
+/// The world that is loaded unless another is chosen with `--vox`, `--svo` or `--world`
+const char* VOX_PATH = "vox/monument/monu16.vox";
 
-    auto loadChunk = [&](){
-        Chunk c;
-        ss.read(reinterpret_cast<char *>(&c), sizeof(Chunk));
-        return c;
-    };
+/// Frames rendered with `--bench`, the camera circles the world at a fixed pace so that every run sees the same views
+const int BENCH_FRAMES = 600;
+const float BENCH_FPS = 60.0f;
 
-    Chunk main = loadChunk();
+/// The logarithmic size of the subtrees written to .svo files with `--write-svo`
+const uchar PAGE_LEVEL = 5;
 
-    assert(main.name[0] == 'M' || main.name[1] == 'A' || main.name[2] == 'I' || main.name[3] == 'N');
+/// Device memory used for the pages of a world streamed with `--svo`
+const size_t STREAMING_MEMORY = 256u << 20;
 
+/// The number of frames the profiler averages over, and the phases of a frame it measures on the device
+const size_t PROFILE_WINDOW = 120;
+enum FramePhase { PHASE_ACQUIRE, PHASE_KERNEL, PHASE_RELEASE };
 
-    int modelCount = 1;
+/// Frames whose traversal counters, gathered with `--stats`, can be in flight before waiting for the oldest of them
+const size_t STATS_LATENCY = 3;
 
-    Chunk pack = loadChunk();
-    if (pack.name[0] == 'P' || pack.name[1] == 'A' || pack.name[2] == 'C' || pack.name[3] == 'K') {
-        ss.read(reinterpret_cast<char *>(&modelCount), sizeof(int));
-    } else {
-        ss.seekg(-ss.gcount(), std::ios::cur);
-    }
 
-    struct XYZI {
-        unsigned char x, y, z, i;
-    };
+/// Color every pixel by the work done for it instead of shading it, must match the kernel.
+/// Heatmaps are cycled through with H, or chosen with `--heatmap <name>`, and use a variant of the kernel that counts the work
+enum HeatmapMode {
+    HEATMAP_OFF,
+    HEATMAP_STEPS,
+    HEATMAP_NODE_FETCHES,
+    HEATMAP_STACK_DEPTH,
+    HEATMAP_SHADOW_STEPS,
+    HEATMAP_LEVEL,
+    HEATMAP_MODES
+};
 
-    std::vector<std::vector<XYZI>> models;
+/// The vertical field of view in degrees
+const float FIELD_OF_VIEW = 80.0f;
 
-    for (int i = 0; i < modelCount; ++i) {
-        Chunk size = loadChunk();
-        assert(size.name[0] == 'S' || size.name[1] == 'I' || size.name[2] == 'Z' || size.name[3] == 'E');
+/// With `--lod` rays stop at nodes that cover no more than this many pixels
+const float LOD_PIXELS = 1.0f;
 
-        int sx, sy, sz;
-        ss.read(reinterpret_cast<char *>(&sx), sizeof(int));
-        ss.read(reinterpret_cast<char *>(&sy), sizeof(int));
-        ss.read(reinterpret_cast<char *>(&sz), sizeof(int));
+/// The size of the image rendered with `--headless`
+const size_t HEADLESS_WIDTH = 1280;
+const size_t HEADLESS_HEIGHT = 720;
 
 
-        Chunk xyzi = loadChunk();
+/// The names of the node orders on the command line, in the order they are declared
+const char* NODE_ORDER_NAMES[] = {"dfs", "bfs", "siblings", "veb"};
 
-        int numVoxels;
-        ss.read(reinterpret_cast<char *>(&numVoxels), sizeof(int));
+/// The names of the heatmaps on the command line, in the order they are declared
+const char* HEATMAP_NAMES[] = {"off", "steps", "fetches", "depth", "shadows", "level"};
 
-        std::vector<XYZI> voxels;
-        voxels.resize(static_cast<unsigned long>(numVoxels));
-        ss.read(reinterpret_cast<char *>(voxels.data()), numVoxels * 4);
 
-        models.push_back(voxels);
+/// Find the node order with a certain name
+NodeOrder parseNodeOrder(const std::string& name) {
+    for (int i = 0; i <= VAN_EMDE_BOAS_ORDER; ++i) {
+        if (name == NODE_ORDER_NAMES[i]) return static_cast<NodeOrder>(i);
     }
 
+    throw std::runtime_error("Unknown node order: " + name);
+}
 
-    size_t pos = static_cast<size_t>(ss.tellg());
-    ss.seekg(0, std::ios::end);
-    size_t end = static_cast<size_t>(ss.tellg());
-    ss.seekg(pos);
 
-    size_t len = end - pos;
+/// Find the heatmap with a certain name
+HeatmapMode parseHeatmapMode(const std::string& name) {
+    for (int i = 0; i < HEATMAP_MODES; ++i) {
+        if (name == HEATMAP_NAMES[i]) return static_cast<HeatmapMode>(i);
+    }
+
+    throw std::runtime_error("Unknown heatmap: " + name);
+}
 
-    //region palette
-    unsigned int palette[256] = {
-            0x00000000, 0xffffffff, 0xffccffff, 0xff99ffff, 0xff66ffff, 0xff33ffff, 0xff00ffff, 0xffffccff, 0xffccccff, 0xff99ccff, 0xff66ccff, 0xff33ccff, 0xff00ccff, 0xffff99ff, 0xffcc99ff, 0xff9999ff, 0xff6699ff, 0xff3399ff, 0xff0099ff, 0xffff66ff, 0xffcc66ff, 0xff9966ff, 0xff6666ff, 0xff3366ff, 0xff0066ff, 0xffff33ff, 0xffcc33ff, 0xff9933ff, 0xff6633ff, 0xff3333ff, 0xff0033ff, 0xffff00ff, 0xffcc00ff, 0xff9900ff, 0xff6600ff, 0xff3300ff, 0xff0000ff, 0xffffffcc, 0xffccffcc, 0xff99ffcc, 0xff66ffcc, 0xff33ffcc, 0xff00ffcc, 0xffffcccc, 0xffcccccc, 0xff99cccc, 0xff66cccc, 0xff33cccc, 0xff00cccc, 0xffff99cc, 0xffcc99cc, 0xff9999cc, 0xff6699cc, 0xff3399cc, 0xff0099cc, 0xffff66cc, 0xffcc66cc, 0xff9966cc, 0xff6666cc, 0xff3366cc, 0xff0066cc, 0xffff33cc, 0xffcc33cc, 0xff9933cc, 0xff6633cc, 0xff3333cc, 0xff0033cc, 0xffff00cc, 0xffcc00cc, 0xff9900cc, 0xff6600cc, 0xff3300cc, 0xff0000cc, 0xffffff99, 0xffccff99, 0xff99ff99, 0xff66ff99, 0xff33ff99, 0xff00ff99, 0xffffcc99, 0xffcccc99, 0xff99cc99, 0xff66cc99, 0xff33cc99, 0xff00cc99, 0xffff9999, 0xffcc9999, 0xff999999, 0xff669999, 0xff339999, 0xff009999, 0xffff6699, 0xffcc6699, 0xff996699, 0xff666699, 0xff336699, 0xff006699, 0xffff3399, 0xffcc3399, 0xff993399, 0xff663399, 0xff333399, 0xff003399, 0xffff0099, 0xffcc0099, 0xff990099, 0xff660099, 0xff330099, 0xff000099, 0xffffff66, 0xffccff66, 0xff99ff66, 0xff66ff66, 0xff33ff66, 0xff00ff66, 0xffffcc66, 0xffcccc66, 0xff99cc66, 0xff66cc66, 0xff33cc66, 0xff00cc66, 0xffff9966, 0xffcc9966, 0xff999966, 0xff669966, 0xff339966, 0xff009966, 0xffff6666, 0xffcc6666, 0xff996666, 0xff666666, 0xff336666, 0xff006666, 0xffff3366, 0xffcc3366, 0xff993366, 0xff663366, 0xff333366, 0xff003366, 0xffff0066, 0xffcc0066, 0xff990066, 0xff660066, 0xff330066, 0xff000066, 0xffffff33, 0xffccff33, 0xff99ff33, 0xff66ff33, 0xff33ff33, 0xff00ff33, 0xffffcc33, 0xffcccc33, 0xff99cc33, 0xff66cc33, 0xff33cc33, 0xff00cc33, 0xffff9933, 0xffcc9933, 0xff999933, 0xff669933, 0xff339933, 0xff009933, 0xffff6633, 0xffcc6633, 0xff996633, 0xff666633, 0xff336633, 0xff006633, 0xffff3333, 0xffcc3333, 0xff993333, 0xff663333, 0xff333333, 0xff003333, 0xffff0033, 0xffcc0033, 0xff990033, 0xff660033, 0xff330033, 0xff000033, 0xffffff00, 0xffccff00, 0xff99ff00, 0xff66ff00, 0xff33ff00, 0xff00ff00, 0xffffcc00, 0xffcccc00, 0xff99cc00, 0xff66cc00, 0xff33cc00, 0xff00cc00, 0xffff9900, 0xffcc9900, 0xff999900, 0xff669900, 0xff339900, 0xff009900, 0xffff6600, 0xffcc6600, 0xff996600, 0xff666600, 0xff336600, 0xff006600, 0xffff3300, 0xffcc3300, 0xff993300, 0xff663300, 0xff333300, 0xff003300, 0xffff0000, 0xffcc0000, 0xff990000, 0xff660000, 0xff330000, 0xff0000ee, 0xff0000dd, 0xff0000bb, 0xff0000aa, 0xff000088, 0xff000077, 0xff000055, 0xff000044, 0xff000022, 0xff000011, 0xff00ee00, 0xff00dd00, 0xff00bb00, 0xff00aa00, 0xff008800, 0xff007700, 0xff005500, 0xff004400, 0xff002200, 0xff001100, 0xffee0000, 0xffdd0000, 0xffbb0000, 0xffaa0000, 0xff880000, 0xff770000, 0xff550000, 0xff440000, 0xff220000, 0xff110000, 0xffeeeeee, 0xffdddddd, 0xffbbbbbb, 0xffaaaaaa, 0xff888888, 0xff777777, 0xff555555, 0xff444444, 0xff222222, 0xff111111
-    };
-    //endregion
 
+/// Write an RGBA image read back from the device to a PNG, the device stores the bottom row first
+void writeImage(const std::string& path, const std::vector<unsigned char>& pixels, size_t width, size_t height) {
+    std::vector<unsigned char> flipped(pixels.size());
+    size_t stride = 4 * width;
 
+    for (size_t row = 0; row < height; ++row) {
+        std::copy(pixels.begin() + row * stride, pixels.begin() + (row + 1) * stride,
+                  flipped.begin() + (height - 1 - row) * stride);
+    }
+
+    unsigned error = lodepng::encode(path, flipped, static_cast<unsigned>(width), static_cast<unsigned>(height));
+    if (error) throw std::runtime_error("Failed to write " + path + ": " + lodepng_error_text(error));
+}
 
-    if (len >= sizeof(Chunk)) {
-        Chunk rgba = loadChunk();
 
-        ss.read(reinterpret_cast<char *>(palette), 4 * 255);
+int main(int argc, char** argv) {
+    NodeOrder nodeOrder = NODE_ORDER;
+    bool benchmark = false, asyncLog = false;
+    std::string svoPath, voxPath = VOX_PATH, writeSvoPath, worldPath, profilePath, tracePath, statsPath, headlessPath;
+    std::string crowdPath, herdPath;
+    HeatmapMode heatmap = HEATMAP_OFF;
+    size_t headlessFrames = 1;
+
+    // The features of the kernel that can be switched at runtime, shadows with O, LOD with L and nodes on the stack with N
+    bool shadows = true, lod = false, stackNodes = false;
+
+    // Where the camera starts and which way it looks, instead of in front of the world
+    bool fixedCamera = false;
+    glm::vec3 cameraEye;
+    float cameraYaw = 0.0, cameraPitch = 0.0;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--bench") {
+            benchmark = true;
+        } else if (arg == "--order" && i + 1 < argc) {
+            nodeOrder = parseNodeOrder(argv[++i]);
+        } else if (arg == "--svo" && i + 1 < argc) {
+            svoPath = argv[++i];
+        } else if (arg == "--vox" && i + 1 < argc) {
+            voxPath = argv[++i];
+        } else if (arg == "--camera" && i + 5 < argc) {
+            fixedCamera = true;
+            cameraEye = glm::vec3(std::stof(argv[i + 1]), std::stof(argv[i + 2]), std::stof(argv[i + 3]));
+            cameraYaw = std::stof(argv[i + 4]);
+            cameraPitch = std::stof(argv[i + 5]);
+            i += 5;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            tracePath = argv[++i];
+            Trace::enable();
+        } else if (arg == "--async-log") {
+            asyncLog = true;
+        } else if (arg == "--no-shadows") {
+            shadows = false;
+        } else if (arg == "--lod") {
+            lod = true;
+        } else if (arg == "--stack-nodes") {
+            stackNodes = true;
+        } else if (arg == "--heatmap" && i + 1 < argc) {
+            heatmap = parseHeatmapMode(argv[++i]);
+        } else if (arg == "--headless" && i + 1 < argc) {
+            headlessPath = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc) {
+            headlessFrames = std::stoul(argv[++i]);
+        } else if (arg == "--stats" && i + 1 < argc) {
+            statsPath = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profilePath = argv[++i];
+        } else if (arg == "--world" && i + 1 < argc) {
+            worldPath = argv[++i];
+        } else if (arg == "--write-svo" && i + 1 < argc) {
+            writeSvoPath = argv[++i];
+        } else if (arg == "--crowd" && i + 1 < argc) {
+            crowdPath = argv[++i];
+        } else if (arg == "--herd" && i + 1 < argc) {
+            herdPath = argv[++i];
+        } else {
+            throw std::runtime_error("Unknown argument: " + arg);
+        }
     }
 
+    // A headless run renders a fixed number of frames without a window, and writes the last one to a PNG
+    if (benchmark) headlessFrames = BENCH_FRAMES;
+
+    // Messages logged in the frame loop are printed by a separate thread
+    if (asyncLog) Log::startAsync();
 
-    int voxelCount = static_cast<int>(models[0].size());
-    for (int j = 0; j < voxelCount; ++j) {
-        XYZI voxel = models[0][j];
+    // Only the top of a streamed world is loaded, the rest is read from the file as it comes into view.
+    // A world manifest is assembled from tiles, which are cached next to it
+    std::unique_ptr<SvoFile> svo;
+    VoxFile vox;
 
-        octree.insert(voxel.x, voxel.z, voxel.y, palette[voxel.i - 1]);
+    if (!svoPath.empty()) {
+        svo.reset(new SvoFile(svoPath));
+        std::copy(svo->getHeader().palette, svo->getHeader().palette + 256, vox.palette);
+        std::copy(svo->getHeader().materials, svo->getHeader().materials + 256, vox.materials);
+    } else if (worldPath.empty()) {
+        vox = readVox(voxPath);
     }
 
-    return octree;
-}
+    Octree octree = svo ? Octree(svo->getTopNodes()[0].size, static_cast<uchar>(svo->getHeader().brickLevel))
+                        : !worldPath.empty() ? buildWorld(readWorldManifest(worldPath), BRICK_LEVEL, worldPath + ".cache", vox.palette, vox.materials)
+                        : buildVoxOctree(vox, BRICK_LEVEL);
+    if (!svo) octree.relayout(nodeOrder);
+    LOG(INFO) << "Loaded " << vox.models.size() << " model(s) in " << vox.instances.size() << " instance(s)";
+
+    if (!writeSvoPath.empty()) {
+        writeSvo(writeSvoPath, octree, PAGE_LEVEL, vox.palette, vox.materials);
+        LOG(INFO) << "Wrote " << writeSvoPath;
+        Log::stopAsync();
+        return 0;
+    }
+
+    std::vector<uint> colors(vox.palette, vox.palette + 256);
+    colors[0] = 0;
+
+    // Every instance of the crowd shares the same nodes, only their transforms are stored per instance
+    Scene scene;
+    if (!crowdPath.empty()) {
+        VoxFile crowd = readVox(crowdPath);
+        remapVoxPalette(crowd, vox.palette, vox.materials);
+
+        uint model = scene.addModel(buildVoxModel(crowd, 0, BRICK_LEVEL));
+        int feet = crowd.models[0].sizeZ / 2;
+
+        for (int i = 0; i < CROWD_SIZE; ++i) {
+            for (int j = 0; j < CROWD_SIZE; ++j) {
+                scene.addInstance(model, (i - CROWD_SIZE / 2) * CROWD_SPACING, feet, -(j + 1) * CROWD_SPACING, i + 2 * j);
+            }
+        }
+    }
 
+    if (!herdPath.empty()) {
+        VoxFile herd = readVox(herdPath);
+        remapVoxPalette(herd, vox.palette, vox.materials);
 
-int main() {
-    Octree octree = loadVox("vox/monument/monu16.vox");
+        size_t nodesBefore = scene.getNodes().size();
+        uint model = scene.addAnimation(buildVoxAnimation(herd, BRICK_LEVEL));
+        LOG(INFO) << "Animation: " << herd.models.size() << " frame(s) in " << scene.getNodes().size() - nodesBefore << " nodes";
+
+        int feet = herd.models[0].sizeZ / 2;
+
+        for (int i = 0; i < HERD_SIZE; ++i) {
+            for (int j = 0; j < HERD_SIZE; ++j) {
+                scene.addInstance(model, 160 + i * HERD_SPACING, feet, j * HERD_SPACING, j, static_cast<uint>(i + 3 * j));
+            }
+        }
+    }
+
+    scene.buildBvh();
+    LOG(INFO) << "Instances: " << scene.getInstances().size() << " sharing " << scene.getNodes().size() << " nodes";
 
     //region Init
     Log::setReportingLevel(INFO);
     std::cout << "Hello, World!" << std::endl;
 
-    // Initialize OpenGL
-    if (!glfwInit()) throw std::runtime_error("Failed to init GLFW!");
+    GLFWwindow* window = nullptr;
+
+    if (headlessPath.empty()) {
+        // Initialize OpenGL
+        if (!glfwInit()) throw std::runtime_error("Failed to init GLFW!");
 
-    // Create a window with an OpenGL context
-    auto monitor = glfwGetPrimaryMonitor();
-    GLFWwindow* window = createWindow(1280, 720, monitor);
+        // Create a window with an OpenGL context
+        auto monitor = glfwGetPrimaryMonitor();
+        window = createWindow(1280, 720, monitor);
+    }
 
 
     // Create the OpenCL device and platform
@@ -378,57 +531,64 @@ int main() {
     findDevicePlatform(CL_DEVICE_TYPE_GPU, window, &platform, &device);
 
 
-    // Create a context, queue and program
+    // Create a context and queue
     cl_context context;
     cl_command_queue queue;
-    cl_program program;
 
-    createProQue(device, platform, window, &context, &queue, &program, "kernel/ray_trace.cl");
+    createContextQueue(device, platform, window, &context, &queue);
+    cl_int error;
 
 
-    // Create a kernel
-    Log().get(INFO) << "Creating kernel...";
-    cl_int error;
-    cl_kernel kernel = clCreateKernel(program, "ray_trace", &error);
-    checkCLError(error);
-    Log().get(INFO) << "Kernel created!";
 
+    // Create a texture, or only an image without a window
+    size_t width = HEADLESS_WIDTH;
+    size_t height = HEADLESS_HEIGHT;
 
+    GLuint texture = 0;
+    GLuint framebuffer = 0;
+    cl_mem image;
 
-    // Create a texture
-    int w, h;
-    glfwGetWindowSize(window, &w, &h);
-    size_t width = static_cast<size_t>(w);
-    size_t height = static_cast<size_t>(h);
+    if (window) {
+        // Create a texture
+        int w, h;
+        glfwGetWindowSize(window, &w, &h);
+        width = static_cast<size_t>(w);
+        height = static_cast<size_t>(h);
 
-    GLuint texture;
-    glGenTextures(1, &texture);
+        glGenTextures(1, &texture);
 
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GLsizei(width), GLsizei(height), GL_FALSE, GL_RGBA, GL_UNSIGNED_BYTE,
-                 nullptr);
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, GLsizei(width), GLsizei(height), GL_FALSE, GL_RGBA, GL_UNSIGNED_BYTE,
+                     nullptr);
 
 
-    // Create a framebuffer
-    GLuint framebuffer;
-    glGenFramebuffers(1, &framebuffer);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        // Create a framebuffer
+        glGenFramebuffers(1, &framebuffer);
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
 
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0);
 
 
 
 
-    // Create an image
-    Log().get(INFO) << "Creating image...";
+        // Create an image
+        LOG(INFO) << "Creating image...";
 
-    cl_mem image = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &error);
-    checkCLError(error);
+        image = clCreateFromGLTexture(context, CL_MEM_WRITE_ONLY, GL_TEXTURE_2D, 0, texture, &error);
+        checkCLError(error);
 
-    Log().get(INFO) << "Image created!";
+        LOG(INFO) << "Image created!";
+    } else {
+        const cl_image_format format = {CL_RGBA, CL_UNORM_INT8};
 
-    error = clSetKernelArg(kernel, 0, sizeof(image), &image);
-    checkCLError(error);
+        cl_image_desc description{};
+        description.image_type = CL_MEM_OBJECT_IMAGE2D;
+        description.image_width = width;
+        description.image_height = height;
+
+        image = clCreateImage(context, CL_MEM_WRITE_ONLY, &format, &description, nullptr, &error);
+        checkCLError(error);
+    }
 
     //endregion
 
@@ -438,21 +598,72 @@ int main() {
     // Create voxels
 
 
-    std::vector<Node> nodes = octree.getNodes();
+    const std::vector<Node>& nodes = octree.getNodes();
 
-    for (int i = 0; i < 7; ++i) {
-        nodes[0].children[i] = nodes[0].children[7];
+    int size = (1u << nodes[0].size);
+    LOG(INFO) << "Size: " << size << "^3 = " << powl(size, 3);
+
+    // The device copies of the nodes and bricks, which grow as the octree does
+    DeviceBuffer voxels(context, queue);
+    DeviceBuffer bricks(context, queue);
+
+    // A streamed world replaces both with a top of the tree and a pool of pages
+    std::unique_ptr<PageStreamer> streamer;
+
+    if (svo) {
+        streamer.reset(new PageStreamer(*svo, context, queue, STREAMING_MEMORY));
+    } else {
+        voxels.upload(octree.getNodeData(), octree.getNodeCount(), sizeof(Node), octree.takeChangedNodes());
+        bricks.upload(octree.getBrickData(), octree.getBrickWordCount(), sizeof(uint), octree.takeChangedBricks());
     }
 
-    int size = (1u << nodes[0].size);
-    Log().get(INFO) << "Size: " << size << "^3 = " << powl(size, 3);
+    LOG(INFO) << "Bricks: " << octree.getBrickWordCount() * sizeof(uint) << " bytes";
+
 
-    cl_mem voxels = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nodes.size() * sizeof(Node), nodes.data(), &error);
+    // Create palette
+    cl_mem palette = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, colors.size() * sizeof(uint), colors.data(), &error);
     checkCLError(error);
 
+    // Create materials, stored as (metal, glass, emission, unused) for every palette index
+    std::vector<float> materialData(4 * 256, 0.0f);
+    for (int i = 0; i < 256; ++i) {
+        materialData[4 * i + 0] = vox.materials[i].metal;
+        materialData[4 * i + 1] = vox.materials[i].glass;
+        materialData[4 * i + 2] = vox.materials[i].emission;
+    }
+
+    cl_mem materials = createBuffer(context, materialData.data(), materialData.size() * sizeof(float));
+
+    int paletteMode = 0;
 
-    error = clSetKernelArg(kernel, 5, sizeof(voxels), &voxels);
-    checkCLError(error);
+
+    // Create empty space distances, the kernel ignores them if the argument is null
+    cl_mem emptyDistances = nullptr;
+    uchar distanceLevel = 0;
+
+    if (EMPTY_SPACE_SKIPPING && !svo) {
+        std::vector<uchar> distances = computeEmptyDistances(nodes, &distanceLevel);
+
+        emptyDistances = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, distances.size(), distances.data(), &error);
+        checkCLError(error);
+    }
+
+    cl_uint distanceUnit = distanceLevel;
+
+
+    // Create the shared models and their instances
+    cl_mem modelNodes = createBuffer(context, scene.getNodes().data(), scene.getNodes().size() * sizeof(Node));
+    cl_mem modelBricks = createBuffer(context, scene.getBricks().data(), scene.getBricks().size() * sizeof(uint));
+    cl_mem modelDistances = createBuffer(context, scene.getDistances().data(), scene.getDistances().size());
+    cl_mem instances = createBuffer(context, scene.getInstances().data(), scene.getInstances().size() * sizeof(Instance));
+    cl_mem bvh = createBuffer(context, scene.getBvh().data(), scene.getBvh().size() * sizeof(BvhNode));
+    cl_mem animationFrames = createBuffer(context, scene.getFrames().data(), scene.getFrames().size() * sizeof(Frame));
+
+    auto bvhSize = static_cast<cl_uint>(scene.getBvh().size());
+
+    // Distances become invalid when voxels are edited, so they are computed again once editing stops
+    bool distancesStale = false;
+    float lastEdit = 0;
 
     // Create loop variables
     float time = 0;
@@ -461,50 +672,171 @@ int main() {
     float frameTime = 0;
     int frames = 0;
 
+    Profiler profiler({"acquire", "kernel", "release"}, PROFILE_WINDOW);
+
+    std::unique_ptr<TraversalStats> stats;
+    if (!statsPath.empty()) stats.reset(new TraversalStats(context, queue, STATS_LATENCY, PROFILE_WINDOW));
+
+
+    // Every combination of features is built from the same source the first time it is used,
+    // and built again in the background whenever the source is saved
+    std::unique_ptr<KernelVariants> variants(new KernelVariants(context, device, "kernel/ray_trace.cl", "ray_trace"));
+
+    KernelFeatures features;
+    features.stats = stats != nullptr;
+
+    // The stack only has to be as deep as the largest octree, it is made deeper if edits grow the root
+    uint depth = nodes[0].size;
+    for (const Node& node : scene.getNodes()) depth = std::max<uint>(depth, node.size);
+    features.stackSize = depth;
 
-    glm::vec3 eye = glm::vec3(0.0, 0.0, -size);
+    // A node covers a pixel when its size is the distance times the size of a pixel on a screen one unit away
+    float lodScale = LOD_PIXELS * 2.0f * std::tan(glm::radians(FIELD_OF_VIEW) / 2.0f) / float(height);
 
+    // Set every argument that doesn't change from frame to frame, again for every variant that is switched to
+    auto bindArguments = [&](cl_kernel kernel) {
+        error = clSetKernelArg(kernel, 0, sizeof(image), &image);
+        checkCLError(error);
+
+        if (streamer) {
+            streamer->bind(kernel);
+        } else {
+            voxels.bind(kernel, 5);
+            bricks.bind(kernel, 6);
+
+            error = clSetKernelArg(kernel, 19, sizeof(cl_mem), nullptr);
+            checkCLError(error);
+
+            cl_uint paging[4] = {0, 0, 0, 0};
+            error = clSetKernelArg(kernel, 20, sizeof(paging), paging);
+            checkCLError(error);
+        }
+
+        error = clSetKernelArg(kernel, 7, sizeof(palette), &palette);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 18, sizeof(materials), &materials);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 8, sizeof(cl_mem), emptyDistances ? &emptyDistances : nullptr);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 9, sizeof(distanceUnit), &distanceUnit);
+        checkCLError(error);
 
-    double x, y;
-    glfwGetCursorPos(window, &x, &y);
+        error = clSetKernelArg(kernel, 10, sizeof(modelNodes), &modelNodes);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 11, sizeof(modelBricks), &modelBricks);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 12, sizeof(cl_mem), EMPTY_SPACE_SKIPPING ? &modelDistances : nullptr);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 13, sizeof(instances), &instances);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 14, sizeof(bvh), &bvh);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 15, sizeof(bvhSize), &bvhSize);
+        checkCLError(error);
+
+        error = clSetKernelArg(kernel, 16, sizeof(animationFrames), &animationFrames);
+        checkCLError(error);
+
+        // The kernel ignores the stats if the argument is null
+        if (!stats) {
+            error = clSetKernelArg(kernel, 21, sizeof(cl_mem), nullptr);
+            checkCLError(error);
+        }
+    };
+
+    cl_kernel kernel = nullptr;
+
+    // Switch to the variant with the current features. Unless `required`, a variant that fails to build
+    // is skipped and the last kernel is kept
+    auto switchVariant = [&](bool required) {
+        cl_kernel variant = variants->get(features);
+        if (!variant && (required || !kernel)) throw std::runtime_error("Failed to build the kernel");
+
+        if (variant && variant != kernel) {
+            kernel = variant;
+            bindArguments(kernel);
+        }
+    };
+
+    // Time spent rendering every frame of the benchmark
+    std::vector<double> benchTimes;
+
+
+    glm::vec3 eye = fixedCamera ? cameraEye : glm::vec3(0.0, 0.0, -size);
+
+
+    double x = 0, y = 0;
+    if (window) glfwGetCursorPos(window, &x, &y);
     glm::vec2 lastMousePos(x, y);
-    float yaw = 0.0, pitch = 0.0;
+    float yaw = cameraYaw, pitch = cameraPitch;
+
+    // Keys that were held down in the last frame, so that toggles only happen once per press
+    std::map<int, bool> keysDown;
+    auto keyPressed = [&](int key) {
+        bool down = window && glfwGetKey(window, key) == GLFW_PRESS;
+        bool pressed = down && !keysDown[key];
+        keysDown[key] = down;
+        return pressed;
+    };
+
+    size_t renderedFrames = 0;
 
 
     std::cout << "\n\n";
 
     // Main loop
-    while (!glfwWindowShouldClose(window)) {
+    while (window ? !glfwWindowShouldClose(window) : renderedFrames < headlessFrames) {
         auto now = std::chrono::high_resolution_clock::now();
         auto duration = now - last;
         last = now;
-        float deltaTime = duration.count() * 1e-9;
+        float deltaTime = benchmark || !window ? 1.0f / BENCH_FPS : duration.count() * 1e-9f;
         time += deltaTime;
 
+        // Every part of the frame is a span of its own in the trace
+        TraceSpan frameSpan("frame");
+        int64_t phaseStart = Trace::now();
+        auto endPhase = [&phaseStart](const char* name) {
+            int64_t phaseEnd = Trace::now();
+            Trace::addHostSpan(name, phaseStart, phaseEnd);
+            phaseStart = phaseEnd;
+        };
+
 
         frames++;
         frameTime += deltaTime;
         if (frameTime > 0.5) {
             int fps = (int) round(frames / frameTime);
             std::cout << "FPS: " << fps << std::endl;
+            profiler.report(std::cout);
+            if (stats) stats->report(std::cout);
             frames = 0;
             frameTime = 0;
         }
 
 
-        glfwPollEvents();
+        if (window) {
+            glfwPollEvents();
 
 
-        double x, y;
-        glfwGetCursorPos(window, &x, &y);
-        glm::vec2 mousePos(x, y);
-        glm::vec2 mouseDelta = mousePos - lastMousePos;
-        lastMousePos = mousePos;
+            double x, y;
+            glfwGetCursorPos(window, &x, &y);
+            glm::vec2 mousePos(x, y);
+            glm::vec2 mouseDelta = mousePos - lastMousePos;
+            lastMousePos = mousePos;
 
 
-        float sensitivity = 0.0005;
-        yaw -= mouseDelta.x * sensitivity;
-        pitch -= mouseDelta.y * sensitivity;
+            float sensitivity = 0.0005;
+            yaw -= mouseDelta.x * sensitivity;
+            pitch -= mouseDelta.y * sensitivity;
+        }
 
 
         float lim = 0.99f * (float) M_PI_2;
@@ -521,36 +853,143 @@ int main() {
         //std::cout << direction.x << " " << direction.y << " " << direction.z << std::endl;
 
 
-        glm::vec3 right = glm::normalize(glm::cross(direction, glm::vec3(0, 1, 0)));
+        if (benchmark) {
+            // Circle the world while looking at its center
+            float angle = 2.0f * float(M_PI) * benchTimes.size() / BENCH_FRAMES;
+            eye = glm::vec3(sin(angle), 0.25f, -cos(angle)) * float(size);
+            direction = glm::normalize(-eye);
+        }
+
 
-        float speed = deltaTime * (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) ? 100.0f : 10.0f);
+        glm::vec3 right = glm::normalize(glm::cross(direction, glm::vec3(0, 1, 0)));
 
-        if (glfwGetKey(window, GLFW_KEY_A)) {
-            eye -= right * speed;
+        if (window) {
+            float speed = deltaTime * (glfwGetKey(window, GLFW_KEY_LEFT_SHIFT) ? 100.0f : 10.0f);
+
+            if (glfwGetKey(window, GLFW_KEY_A)) {
+                eye -= right * speed;
+            }
+            if (glfwGetKey(window, GLFW_KEY_D)) {
+                eye += right * speed;
+            }
+
+            if (glfwGetKey(window, GLFW_KEY_W)) {
+                eye += direction * speed;
+            }
+            if (glfwGetKey(window, GLFW_KEY_S)) {
+                eye -= direction * speed;
+            }
+
+            if (glfwGetKey(window, GLFW_KEY_E)) {
+                eye.y += speed;
+            }
+            if (glfwGetKey(window, GLFW_KEY_Q)) {
+                eye.y -= speed;
+            }
         }
-        if (glfwGetKey(window, GLFW_KEY_D)) {
-            eye += right * speed;
+
+        endPhase("input");
+
+        // Swap the palette, the voxels only store palette indices so nothing else has to change
+        if (keyPressed(GLFW_KEY_P)) {
+            paletteMode = (paletteMode + 1) % PALETTE_MODES;
+            std::vector<uint> recolored = recolorPalette(colors, paletteMode);
+
+            error = clEnqueueWriteBuffer(queue, palette, CL_TRUE, 0, recolored.size() * sizeof(uint), recolored.data(), 0, nullptr, nullptr);
+            checkCLError(error);
         }
 
-        if (glfwGetKey(window, GLFW_KEY_W)) {
-            eye += direction * speed;
+        if (keyPressed(GLFW_KEY_H)) {
+            heatmap = static_cast<HeatmapMode>((heatmap + 1) % HEATMAP_MODES);
+            LOG(INFO) << "Heatmap: " << HEATMAP_NAMES[heatmap];
         }
-        if (glfwGetKey(window, GLFW_KEY_S)) {
-            eye -= direction * speed;
+
+        if (keyPressed(GLFW_KEY_O)) shadows = !shadows;
+        if (keyPressed(GLFW_KEY_L)) lod = !lod;
+        if (keyPressed(GLFW_KEY_N)) stackNodes = !stackNodes;
+
+        // Switch to the variant of the kernel with the features that are asked for, building it the first time.
+        // Variants rebuilt after the kernel's source changed are swapped in here, between frames
+        features.shadows = shadows;
+        features.lod = lod ? lodScale : 0.0f;
+        features.stackNodes = stackNodes;
+        features.heatmap = heatmap != HEATMAP_OFF;
+
+        variants->update();
+        switchVariant(false);
+
+
+        // Edit the voxels in front of the camera
+        bool digging = window && !benchmark && !svo && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
+        bool building = window && !benchmark && !svo && glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
+
+        if (digging || building) {
+            glm::ivec3 target = glm::ivec3(glm::floor(eye + direction * EDIT_REACH));
+            int radius = digging ? DIG_RADIUS : BUILD_RADIUS;
+
+            octree.fillBox(target.x - radius, target.y - radius, target.z - radius,
+                           target.x + radius, target.y + radius, target.z + radius,
+                           digging ? 0 : BUILD_COLOR);
+
+            // Building far away grows the root, and a kernel with a shallower stack would overflow it
+            if (octree.getNodes()[0].size > features.stackSize) {
+                features.stackSize = octree.getNodes()[0].size;
+                switchVariant(true);
+            }
+
+            // Any edit invalidates the distances: removed voxels leave their children marked as occupied,
+            // and new nodes, split or reused from the free list, have no distances or stale ones
+            if (emptyDistances) {
+                clReleaseMemObject(emptyDistances);
+                emptyDistances = nullptr;
+
+                error = clSetKernelArg(kernel, 8, sizeof(cl_mem), nullptr);
+                checkCLError(error);
+
+                distancesStale = true;
+            }
+
+            lastEdit = time;
         }
 
-        if (glfwGetKey(window, GLFW_KEY_E)) {
-            eye.y += speed;
+        if (distancesStale && time - lastEdit > DISTANCE_UPDATE_DELAY) {
+            std::vector<uchar> distances = computeEmptyDistances(octree.getNodes(), &distanceLevel);
+
+            emptyDistances = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, distances.size(), distances.data(), &error);
+            checkCLError(error);
+
+            error = clSetKernelArg(kernel, 8, sizeof(emptyDistances), &emptyDistances);
+            checkCLError(error);
+
+            distanceUnit = distanceLevel;
+            error = clSetKernelArg(kernel, 9, sizeof(distanceUnit), &distanceUnit);
+            checkCLError(error);
+
+            distancesStale = false;
         }
-        if (glfwGetKey(window, GLFW_KEY_Q)) {
-            eye.y -= speed;
+
+
+        endPhase("edit");
+
+        // Upload the edited parts of the octree, or the pages that were asked for by the last frame
+        if (streamer) {
+            streamer->upload();
+            streamer->bind(kernel);
+        } else {
+            if (voxels.upload(octree.getNodeData(), octree.getNodeCount(), sizeof(Node), octree.takeChangedNodes())) {
+                voxels.bind(kernel, 5);
+            }
+
+            if (bricks.upload(octree.getBrickData(), octree.getBrickWordCount(), sizeof(uint), octree.takeChangedBricks())) {
+                bricks.bind(kernel, 6);
+            }
         }
 
 
         // Render
 
         // Calculate projection
-        glm::mat4 projection = glm::perspective(glm::radians(80.0f), float(width) / float(height), 0.01f, 100.0f);
+        glm::mat4 projection = glm::perspective(glm::radians(FIELD_OF_VIEW), float(width) / float(height), 0.01f, 100.0f);
         glm::mat4 view = glm::lookAt(eye, eye + direction, glm::vec3(0, 1, 0));
 
         glm::mat4 inverse_matrix = glm::inverse(projection * view);
@@ -574,45 +1013,145 @@ int main() {
         error = clSetKernelArg(kernel, 4, 4 * sizeof(float), &lightDirection);
         checkCLError(error);
 
+        // Animations only switch which root they start from
+        auto frame = static_cast<cl_uint>(time * ANIMATION_FPS);
+        error = clSetKernelArg(kernel, 17, sizeof(frame), &frame);
+        checkCLError(error);
+
+        if (stats) stats->bind(kernel, 21);
+
+        auto heatmapMode = static_cast<cl_uint>(heatmap);
+        error = clSetKernelArg(kernel, 22, sizeof(heatmapMode), &heatmapMode);
+        checkCLError(error);
+
+
+        endPhase("upload");
 
         // Execute the kernel
-        glFlush();
-        error = clEnqueueAcquireGLObjects(queue, 1, &image, 0, nullptr, nullptr);
+        if (window) glFlush();
+        auto renderStart = std::chrono::high_resolution_clock::now();
+
+        // Without a window there is no texture to share, markers take the place of acquiring and releasing it
+        cl_event acquireEvent, kernelEvent, releaseEvent;
+        if (window) {
+            error = clEnqueueAcquireGLObjects(queue, 1, &image, 0, nullptr, &acquireEvent);
+        } else {
+            error = clEnqueueMarkerWithWaitList(queue, 0, nullptr, &acquireEvent);
+        }
         checkCLError(error);
 
         const size_t global_work_size[] = {width, height, 0};
-        error = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global_work_size, nullptr, 0, nullptr, nullptr);
+        error = clEnqueueNDRangeKernel(queue, kernel, 2, nullptr, global_work_size, nullptr, 0, nullptr, &kernelEvent);
         checkCLError(error);
 
-        error = clEnqueueReleaseGLObjects(queue, 1, &image, 0, nullptr, nullptr);
+        if (window) {
+            error = clEnqueueReleaseGLObjects(queue, 1, &image, 0, nullptr, &releaseEvent);
+        } else {
+            error = clEnqueueMarkerWithWaitList(queue, 0, nullptr, &releaseEvent);
+        }
         checkCLError(error);
 
+        if (stats) stats->read();
+
         error = clFinish(queue);
         checkCLError(error);
 
+        endPhase("render");
+
+        EventTimes acquireTimes = profiler.record(PHASE_ACQUIRE, acquireEvent);
+        EventTimes kernelTimes = profiler.record(PHASE_KERNEL, kernelEvent);
+        EventTimes releaseTimes = profiler.record(PHASE_RELEASE, releaseEvent);
+
+        // The device has its own clock, which is lined up with the host's by assuming that the frame's last command just ended
+        auto deviceOffset = phaseStart - static_cast<int64_t>(releaseTimes.end);
+        Trace::addDeviceSpan("acquire", deviceOffset + acquireTimes.start, deviceOffset + acquireTimes.end);
+        Trace::addDeviceSpan("kernel", deviceOffset + kernelTimes.start, deviceOffset + kernelTimes.end);
+        Trace::addDeviceSpan("release", deviceOffset + releaseTimes.start, deviceOffset + releaseTimes.end);
+
+        if (streamer) {
+            streamer->update();
+            endPhase("stream");
+        }
+
+        if (benchmark) {
+            std::chrono::duration<double, std::milli> renderTime = std::chrono::high_resolution_clock::now() - renderStart;
+            benchTimes.push_back(renderTime.count());
+
+            if (benchTimes.size() == BENCH_FRAMES) {
+                std::sort(benchTimes.begin(), benchTimes.end());
+
+                double total = 0;
+                for (double t : benchTimes) total += t;
+
+                std::cout << "Order: " << NODE_ORDER_NAMES[nodeOrder] << ", nodes: " << octree.getNodeCount()
+                          << ", mean: " << total / BENCH_FRAMES << " ms"
+                          << ", median: " << benchTimes[BENCH_FRAMES / 2] << " ms"
+                          << ", max: " << benchTimes.back() << " ms" << std::endl;
+
+                if (window) glfwSetWindowShouldClose(window, true);
+            }
+        }
 
-        glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
-        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
-        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        if (window) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
+            glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+            endPhase("blit");
 
-        glfwSwapBuffers(window);
+
+            glfwSwapBuffers(window);
+            endPhase("swap");
+        }
+
+        renderedFrames++;
+
+        std::chrono::duration<double, std::milli> hostTime = std::chrono::high_resolution_clock::now() - now;
+        profiler.endFrame(hostTime.count());
+    }
+
+    if (!profilePath.empty()) profiler.write(profilePath);
+    if (!tracePath.empty()) Trace::write(tracePath);
+    if (stats) stats->write(statsPath);
+
+    if (!window) {
+        std::vector<unsigned char> pixels(4 * width * height);
+        const size_t origin[3] = {0, 0, 0};
+        const size_t region[3] = {width, height, 1};
+
+        error = clEnqueueReadImage(queue, image, CL_TRUE, origin, region, 0, 0, pixels.data(), 0, nullptr, nullptr);
+        checkCLError(error);
+
+        writeImage(headlessPath, pixels, width, height);
+        LOG(INFO) << "Wrote " << headlessPath;
     }
 
 
 
     // Release all OpenCL objects
     clReleaseMemObject(image);
-
-    clReleaseKernel(kernel);
-    clReleaseProgram(program);
+    clReleaseMemObject(palette);
+    clReleaseMemObject(materials);
+    if (emptyDistances) clReleaseMemObject(emptyDistances);
+    clReleaseMemObject(modelNodes);
+    clReleaseMemObject(modelBricks);
+    clReleaseMemObject(modelDistances);
+    clReleaseMemObject(instances);
+    clReleaseMemObject(bvh);
+    clReleaseMemObject(animationFrames);
+    streamer.reset();
+    stats.reset();
+
+    variants.reset();
     clReleaseCommandQueue(queue);
 
     clReleaseContext(context);
     clReleaseDevice(device);
 
-    glfwTerminate();
+    if (window) glfwTerminate();
+
+    Log::stopAsync();
 }
 
 
@@ -0,0 +1,178 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+#include <cmath>
+#include <climits>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "Octree.h"
+#include "Vox.h"
+#include "Traversal.h"
+
+
+/// The brick size the octrees are built with, the same as the renderer uses
+const uchar BRICK_LEVEL = 3;
+
+/// Every measurement is repeated this many times, and the median is reported
+const int REPEATS = 5;
+
+/// The rays traced through every octree: a square image seen from a number of views circling it,
+/// and the tangent of half the field of view
+const int VIEWS = 8;
+const int RAYS_PER_SIDE = 128;
+const float FIELD_OF_VIEW_SLOPE = 0.6f;
+
+
+/// Find every .vox file below a directory, in sorted order
+static void findVoxFiles(const std::string& directory, std::vector<std::string>& paths) {
+    DIR* dir = opendir(directory.c_str());
+    if (!dir) throw std::runtime_error("Failed to open directory: " + directory);
+
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") continue;
+
+        std::string path = directory + "/" + name;
+
+        struct stat info{};
+        if (stat(path.c_str(), &info) != 0) continue;
+
+        if (S_ISDIR(info.st_mode)) {
+            findVoxFiles(path, paths);
+        } else if (name.size() > 4 && name.compare(name.size() - 4, 4, ".vox") == 0) {
+            paths.push_back(path);
+        }
+    }
+
+    closedir(dir);
+    std::sort(paths.begin(), paths.end());
+}
+
+
+/// Run `work` a number of times and return the median number of seconds it took
+template <typename Work>
+static double medianSeconds(Work work) {
+    std::vector<double> times;
+
+    for (int i = 0; i < REPEATS; ++i) {
+        auto start = std::chrono::high_resolution_clock::now();
+        work();
+        std::chrono::duration<double> duration = std::chrono::high_resolution_clock::now() - start;
+        times.push_back(duration.count());
+    }
+
+    std::sort(times.begin(), times.end());
+    return times[REPEATS / 2];
+}
+
+
+/// The origin and direction of every ray traced through an octree, every view sees all of its occupied bounds
+static std::vector<std::pair<glm::vec3, glm::vec3>> createRays(const Octree& octree) {
+    std::vector<std::pair<glm::vec3, glm::vec3>> rays;
+
+    int min[3] = {INT_MAX, INT_MAX, INT_MAX}, max[3] = {INT_MIN, INT_MIN, INT_MIN};
+    octree.growOccupiedBounds(min, max);
+    if (min[0] > max[0]) return rays;
+
+    glm::vec3 center = 0.5f * (glm::vec3(min[0], min[1], min[2]) + glm::vec3(max[0], max[1], max[2]));
+    float radius = 0.5f * glm::length(glm::vec3(max[0] - min[0], max[1] - min[1], max[2] - min[2]));
+
+    for (int view = 0; view < VIEWS; ++view) {
+        // Circle the bounds while looking at their center, as `ray_trace --bench` does.
+        // From twice the radius a bounding sphere fills a field of view of 60 degrees
+        float angle = 2.0f * float(M_PI) * view / VIEWS;
+        glm::vec3 eye = center + glm::normalize(glm::vec3(std::sin(angle), 0.25f, -std::cos(angle))) * 2.0f * radius;
+        glm::vec3 forward = glm::normalize(center - eye);
+        glm::vec3 right = glm::normalize(glm::cross(forward, glm::vec3(0, 1, 0)));
+        glm::vec3 up = glm::cross(right, forward);
+
+        for (int y = 0; y < RAYS_PER_SIDE; ++y) {
+            for (int x = 0; x < RAYS_PER_SIDE; ++x) {
+                float screenX = ((x + 0.5f) / RAYS_PER_SIDE * 2.0f - 1.0f) * FIELD_OF_VIEW_SLOPE;
+                float screenY = ((y + 0.5f) / RAYS_PER_SIDE * 2.0f - 1.0f) * FIELD_OF_VIEW_SLOPE;
+
+                rays.emplace_back(eye, glm::normalize(forward + screenX * right + screenY * up));
+            }
+        }
+    }
+
+    return rays;
+}
+
+
+int main(int argc, char** argv) {
+    std::string directory = "vox", outputPath;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else {
+            directory = arg;
+        }
+    }
+
+    std::ofstream outputFile;
+    if (!outputPath.empty()) {
+        outputFile.open(outputPath);
+        if (!outputFile) {
+            std::cerr << "Failed to create file: " << outputPath << std::endl;
+            return 1;
+        }
+    }
+
+    std::ostream& output = outputPath.empty() ? std::cout : outputFile;
+
+    try {
+        std::vector<std::string> paths;
+        findVoxFiles(directory, paths);
+
+        output << "file,bytes,voxels,nodes,brick_words,parse_mb_per_s,build_voxels_per_s,rays,hits,steps,trace_rays_per_s"
+               << std::endl;
+
+        for (const std::string& path : paths) {
+            struct stat info{};
+            stat(path.c_str(), &info);
+
+            VoxFile vox;
+            double parseSeconds = medianSeconds([&] { vox = readVox(path); });
+
+            size_t voxels = 0;
+            for (const VoxInstance& instance : vox.instances) voxels += vox.models[instance.model].voxels.size();
+
+            Octree octree(4, BRICK_LEVEL);
+            double buildSeconds = medianSeconds([&] { octree = buildVoxOctree(vox, BRICK_LEVEL); });
+
+            std::vector<std::pair<glm::vec3, glm::vec3>> rays = createRays(octree);
+            size_t hits = 0, steps = 0;
+
+            double traceSeconds = medianSeconds([&] {
+                hits = steps = 0;
+
+                for (const std::pair<glm::vec3, glm::vec3>& ray : rays) {
+                    RayHit hit{};
+                    if (traceOctree(octree, ray.first, ray.second, &hit, &steps)) hits++;
+                }
+            });
+
+            output << path << "," << info.st_size << "," << voxels << "," << octree.getNodeCount() << ","
+                   << octree.getBrickWordCount() << ","
+                   << info.st_size / parseSeconds / 1e6 << ","
+                   << voxels / buildSeconds << ","
+                   << rays.size() << "," << hits << "," << steps << ","
+                   << rays.size() / traceSeconds << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+
+#include "lodepng/lodepng.h"
+
+
+/// The views to render, golden images and kernel time budgets, relative to the repository
+const std::string VIEWS_PATH = "regress/views.txt";
+const std::string BUDGETS_PATH = "regress/budgets.txt";
+const std::string GOLDEN_DIR = "regress/golden/";
+const std::string OUTPUT_DIR = "regress/out/";
+
+/// Frames rendered for every view, the kernel time is the median over all of them and the last frame is compared
+const int FRAMES = 30;
+
+/// A pixel differs if any channel is further than this from the golden image,
+/// and a view fails if more than a fraction of its pixels differ
+const int PIXEL_TOLERANCE = 16;
+const double MAX_DIFFERING_PIXELS = 0.001;
+
+/// A view fails if its kernel is this much slower than its budget
+const double BUDGET_THRESHOLD = 0.10;
+
+
+/// A fixed camera in a world loaded from a .vox file, and any other options the renderer is run with
+struct View {
+    std::string name, vox;
+    float eye[3], yaw, pitch;
+    std::vector<std::string> options;
+};
+
+
+/// The difference between a rendered image and its golden image
+struct ImageDiff {
+    size_t differing, pixels;
+    double rootMeanSquare;
+};
+
+
+/// Read the views, one per line: `name vox x y z yaw pitch [options...]`. Empty lines and lines starting with # are skipped
+static std::vector<View> readViews(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) throw std::runtime_error("Failed to open file: " + path);
+
+    std::vector<View> views;
+    std::string line;
+
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::istringstream words(line);
+        View view;
+        if (!(words >> view.name >> view.vox >> view.eye[0] >> view.eye[1] >> view.eye[2] >> view.yaw >> view.pitch)) {
+            throw std::runtime_error("Invalid view in " + path + ": " + line);
+        }
+
+        std::string option;
+        while (words >> option) view.options.push_back(option);
+
+        views.push_back(view);
+    }
+
+    return views;
+}
+
+
+/// Read the kernel time budgets in milliseconds, one per line: `name milliseconds`. A missing file has no budgets
+static std::map<std::string, double> readBudgets(const std::string& path) {
+    std::map<std::string, double> budgets;
+
+    std::ifstream file(path);
+    std::string name;
+    double milliseconds;
+    while (file >> name >> milliseconds) budgets[name] = milliseconds;
+
+    return budgets;
+}
+
+
+static void writeBudgets(const std::string& path, const std::map<std::string, double>& budgets) {
+    std::ofstream file(path);
+    if (!file) throw std::runtime_error("Failed to create file: " + path);
+
+    file << std::fixed << std::setprecision(3);
+    for (const auto& budget : budgets) file << budget.first << " " << budget.second << "\n";
+}
+
+
+/// Quote an argument for the shell
+static std::string quote(const std::string& argument) {
+    std::string quoted = "'";
+
+    for (char c : argument) {
+        if (c == '\'') quoted += "'\\''";
+        else quoted += c;
+    }
+
+    return quoted + "'";
+}
+
+
+/// Render a view headless to `imagePath`, writing the renderer's device times to `profilePath`
+static void render(const std::string& renderer, const View& view, const std::string& imagePath, const std::string& profilePath) {
+    std::ostringstream command;
+    command << quote(renderer) << " --vox " << quote(view.vox)
+            << " --camera " << view.eye[0] << " " << view.eye[1] << " " << view.eye[2] << " " << view.yaw << " " << view.pitch
+            << " --headless " << quote(imagePath) << " --frames " << FRAMES << " --profile " << quote(profilePath);
+
+    for (const std::string& option : view.options) command << " " << quote(option);
+    command << " > " << quote(OUTPUT_DIR + view.name + ".log") << " 2>&1";
+
+    if (std::system(command.str().c_str()) != 0) {
+        throw std::runtime_error("Failed to render " + view.name + ", see " + OUTPUT_DIR + view.name + ".log");
+    }
+}
+
+
+/// The median time the kernel took on the device in milliseconds, from a profile written by the renderer
+static double medianKernelTime(const std::string& profilePath) {
+    std::ifstream file(profilePath);
+    if (!file) throw std::runtime_error("Failed to open file: " + profilePath);
+
+    // frame,phase,queued_ns,submit_ns,start_ns,end_ns,host_ms
+    std::vector<double> times;
+    std::string line;
+    std::getline(file, line);
+
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields;
+        std::istringstream columns(line);
+        std::string field;
+        while (std::getline(columns, field, ',')) fields.push_back(field);
+
+        if (fields.size() < 6 || fields[1] != "kernel") continue;
+        times.push_back((std::stod(fields[5]) - std::stod(fields[4])) * 1e-6);
+    }
+
+    if (times.empty()) throw std::runtime_error("No kernel times in " + profilePath);
+
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+
+static void readImage(const std::string& path, std::vector<unsigned char>& pixels, unsigned& width, unsigned& height) {
+    unsigned error = lodepng::decode(pixels, width, height, path);
+    if (error) throw std::runtime_error("Failed to read " + path + ": " + lodepng_error_text(error));
+}
+
+
+/// Compare the color channels of two images of the same size, writing the differing pixels in red over a dimmed
+/// copy of the golden image to `diffPath` if there are any
+static ImageDiff compareImages(const std::vector<unsigned char>& image, const std::vector<unsigned char>& golden,
+                               unsigned width, unsigned height, const std::string& diffPath) {
+    ImageDiff diff{0, size_t(width) * height, 0.0};
+    std::vector<unsigned char> diffImage(golden.size());
+
+    double squares = 0.0;
+
+    for (size_t pixel = 0; pixel < diff.pixels; ++pixel) {
+        int largest = 0;
+
+        for (size_t channel = 0; channel < 3; ++channel) {
+            int delta = std::abs(int(image[4 * pixel + channel]) - int(golden[4 * pixel + channel]));
+            largest = std::max(largest, delta);
+            squares += double(delta) * delta;
+
+            diffImage[4 * pixel + channel] = static_cast<unsigned char>(golden[4 * pixel + channel] / 4);
+        }
+
+        if (largest > PIXEL_TOLERANCE) {
+            diff.differing++;
+            diffImage[4 * pixel] = 255;
+        }
+
+        diffImage[4 * pixel + 3] = 255;
+    }
+
+    diff.rootMeanSquare = std::sqrt(squares / (3.0 * diff.pixels));
+
+    if (diff.differing > 0) {
+        unsigned error = lodepng::encode(diffPath, diffImage, width, height);
+        if (error) throw std::runtime_error("Failed to write " + diffPath + ": " + lodepng_error_text(error));
+    }
+
+    return diff;
+}
+
+
+int main(int argc, char** argv) {
+    std::string renderer = "./ray_trace", only;
+    bool update = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--renderer" && i + 1 < argc) {
+            renderer = argv[++i];
+        } else if (arg == "--only" && i + 1 < argc) {
+            only = argv[++i];
+        } else if (arg == "--update") {
+            update = true;
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--renderer <ray_trace>] [--only <view>] [--update]" << std::endl;
+            return 1;
+        }
+    }
+
+    try {
+        std::vector<View> views = readViews(VIEWS_PATH);
+        std::map<std::string, double> budgets = readBudgets(BUDGETS_PATH);
+
+        for (const std::string& directory : {OUTPUT_DIR, GOLDEN_DIR}) {
+            if (std::system(("mkdir -p " + quote(directory)).c_str()) != 0) {
+                throw std::runtime_error("Failed to create directory: " + directory);
+            }
+        }
+
+        size_t failures = 0;
+        std::cout << std::fixed << std::setprecision(3);
+
+        for (const View& view : views) {
+            if (!only.empty() && view.name != only) continue;
+
+            std::string imagePath = OUTPUT_DIR + view.name + ".png";
+            std::string goldenPath = GOLDEN_DIR + view.name + ".png";
+
+            render(renderer, view, imagePath, OUTPUT_DIR + view.name + ".csv");
+            double kernelTime = medianKernelTime(OUTPUT_DIR + view.name + ".csv");
+
+            std::vector<unsigned char> image;
+            unsigned width, height;
+            readImage(imagePath, image, width, height);
+
+            // The rendered image becomes the golden one, and its kernel time the budget
+            if (update) {
+                unsigned error = lodepng::encode(goldenPath, image, width, height);
+                if (error) throw std::runtime_error("Failed to write " + goldenPath + ": " + lodepng_error_text(error));
+
+                budgets[view.name] = kernelTime;
+                std::cout << view.name << ": updated, kernel " << kernelTime << " ms" << std::endl;
+                continue;
+            }
+
+            std::vector<std::string> problems;
+            std::cout << view.name << ":";
+
+            if (!std::ifstream(goldenPath)) {
+                std::cout << " no golden image";
+                problems.push_back("missing " + goldenPath + ", run with --update to create it");
+            } else {
+                std::vector<unsigned char> golden;
+                unsigned goldenWidth, goldenHeight;
+                readImage(goldenPath, golden, goldenWidth, goldenHeight);
+
+                if (width != goldenWidth || height != goldenHeight) {
+                    std::cout << " " << width << " x " << height << " instead of " << goldenWidth << " x " << goldenHeight;
+                    problems.push_back("size differs from golden image");
+                } else {
+                    ImageDiff diff = compareImages(image, golden, width, height, OUTPUT_DIR + view.name + ".diff.png");
+                    double fraction = double(diff.differing) / diff.pixels;
+
+                    std::cout << " " << 100.0 * fraction << "% of pixels differ, rms " << diff.rootMeanSquare;
+                    if (fraction > MAX_DIFFERING_PIXELS) {
+                        problems.push_back("image differs, see " + OUTPUT_DIR + view.name + ".diff.png");
+                    }
+                }
+            }
+
+            std::cout << ", kernel " << kernelTime << " ms";
+
+            auto budget = budgets.find(view.name);
+            if (budget == budgets.end()) {
+                std::cout << " (no budget)";
+            } else {
+                std::cout << " (budget " << budget->second << " ms)";
+                if (kernelTime > budget->second * (1.0 + BUDGET_THRESHOLD)) problems.push_back("kernel over budget");
+            }
+
+            std::cout << std::endl;
+
+            for (const std::string& problem : problems) std::cout << "    FAIL: " << problem << std::endl;
+            if (!problems.empty()) failures++;
+        }
+
+        if (update) {
+            writeBudgets(BUDGETS_PATH, budgets);
+            return 0;
+        }
+
+        if (failures > 0) {
+            std::cout << failures << " view(s) failed" << std::endl;
+            return 1;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,225 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <climits>
+#include <algorithm>
+#include <stdexcept>
+
+#include "Octree.h"
+#include "Vox.h"
+#include "Svo.h"
+#include "Scene.h"
+
+
+/// The brick sizes a .vox file is built with, every one of them stores the same voxels differently
+const uchar BRICK_LEVELS[] = {0, 2, 3};
+
+
+/// The structure of an octree, gathered by walking it from the root
+struct OctreeStats {
+    /// Nodes, leaves and bricks at every logarithmic size
+    std::vector<size_t> nodes, leaves, bricks;
+
+    /// The number of children of the nodes that are neither leaves nor bricks
+    size_t innerNodes, innerChildren;
+
+    size_t voxels;
+
+    /// The smallest and largest occupied voxel
+    int min[3], max[3];
+};
+
+
+/// Count every node below a node whose minimum corner is at (x, y, z)
+static void walk(const Octree& octree, uint index, int x, int y, int z, OctreeStats& stats) {
+    const Node& node = octree.getNodeData()[index];
+    int size = 1 << node.size;
+
+    stats.nodes[node.size]++;
+
+    if (node.flags & NODE_LEAF) {
+        stats.leaves[node.size]++;
+        stats.voxels += size_t(size) * size * size;
+
+        int corner[3] = {x, y, z};
+        for (int i = 0; i < 3; ++i) {
+            stats.min[i] = std::min(stats.min[i], corner[i]);
+            stats.max[i] = std::max(stats.max[i], corner[i] + size - 1);
+        }
+
+        return;
+    }
+
+    if (node.flags & NODE_BRICK) {
+        stats.bricks[node.size]++;
+
+        const uint* occupancy = octree.getBrickData() + node.children[0];
+        for (int i = 0; i < size * size * size; ++i) {
+            if (!((occupancy[i / 32] >> (i % 32)) & 1)) continue;
+
+            int voxel[3] = {x + i / (size * size), y + (i / size) % size, z + i % size};
+            for (int j = 0; j < 3; ++j) {
+                stats.min[j] = std::min(stats.min[j], voxel[j]);
+                stats.max[j] = std::max(stats.max[j], voxel[j]);
+            }
+
+            stats.voxels++;
+        }
+
+        return;
+    }
+
+    stats.innerNodes++;
+
+    int half = size / 2;
+    for (int i = 0; i < 8; ++i) {
+        if (node.children[i] == 0) continue;
+
+        stats.innerChildren++;
+        walk(octree, node.children[i],
+             x + ((i & 0b100) ? half : 0),
+             y + ((i & 0b010) ? half : 0),
+             z + ((i & 0b001) ? half : 0),
+             stats);
+    }
+}
+
+
+static OctreeStats gatherStats(const Octree& octree) {
+    OctreeStats stats{};
+
+    size_t levels = octree.getNodeData()[0].size + 1u;
+    stats.nodes.assign(levels, 0);
+    stats.leaves.assign(levels, 0);
+    stats.bricks.assign(levels, 0);
+
+    std::fill(stats.min, stats.min + 3, INT_MAX);
+    std::fill(stats.max, stats.max + 3, INT_MIN);
+
+    int half = 1 << (octree.getNodeData()[0].size - 1);
+    walk(octree, 0, -half, -half, -half, stats);
+
+    return stats;
+}
+
+
+/// The bytes a device needs for the nodes and bricks that are in use
+static size_t deviceBytes(const std::vector<size_t>& nodes, const std::vector<size_t>& bricks, uchar brickLevel) {
+    size_t nodeCount = 0, brickCount = 0;
+    for (size_t count : nodes) nodeCount += count;
+    for (size_t count : bricks) brickCount += count;
+
+    return nodeCount * sizeof(Node) + (brickLevel > 0 ? brickCount * brickWords(brickLevel) * sizeof(uint) : 0);
+}
+
+
+/// Load every page of an .svo file into a single octree
+static Octree loadSvo(const std::string& path) {
+    SvoFile file(path);
+    const SvoHeader& header = file.getHeader();
+
+    std::vector<Node> nodes(file.getTopNodes(), file.getTopNodes() + header.topNodeCount);
+    std::vector<uint> bricks;
+
+    std::vector<Node> pageNodes;
+    std::vector<uint> pageBricks;
+
+    for (uint page = 0; page < header.pageCount; ++page) {
+        file.readPage(page, static_cast<uint>(nodes.size()), static_cast<uint>(bricks.size()), &pageNodes, &pageBricks);
+
+        // The page's root replaces its NODE_PAGE node, the copy of it that is appended is never referred to
+        nodes[file.getPage(page).node] = pageNodes[0];
+
+        nodes.insert(nodes.end(), pageNodes.begin(), pageNodes.end());
+        bricks.insert(bricks.end(), pageBricks.begin(), pageBricks.end());
+    }
+
+    std::cout << path << ": " << header.pageCount << " page(s) of at most " << header.maxPageNodes << " nodes and "
+              << header.maxPageBrickWords * sizeof(uint) << " brick bytes" << std::endl;
+
+    return Octree(std::move(nodes), std::move(bricks), static_cast<uchar>(header.brickLevel));
+}
+
+
+/// Print the structure of an octree, and how much it would take if identical subtrees were shared
+static void printStats(const Octree& octree) {
+    OctreeStats stats = gatherStats(octree);
+    uchar brickLevel = octree.getBrickLevel();
+
+    std::cout << "level      nodes     leaves     bricks" << std::endl;
+    for (size_t level = stats.nodes.size(); level > 0; --level) {
+        std::cout << std::setw(5) << level - 1
+                  << std::setw(11) << stats.nodes[level - 1]
+                  << std::setw(11) << stats.leaves[level - 1]
+                  << std::setw(11) << stats.bricks[level - 1] << std::endl;
+    }
+
+    size_t nodeCount = 0, leafCount = 0;
+    for (size_t count : stats.nodes) nodeCount += count;
+    for (size_t count : stats.leaves) leafCount += count;
+
+    size_t bytes = deviceBytes(stats.nodes, stats.bricks, brickLevel);
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "nodes: " << nodeCount << " (" << octree.getNodeCount() - nodeCount << " unused), leaves: " << leafCount
+              << ", children per inner node: " << double(stats.innerChildren) / std::max<size_t>(stats.innerNodes, 1) << std::endl;
+    std::cout << "voxels: " << stats.voxels << ", bytes: " << bytes
+              << ", bytes per voxel: " << double(bytes) / std::max<size_t>(stats.voxels, 1) << std::endl;
+
+    if (stats.voxels > 0) {
+        std::cout << "bounds: (" << stats.min[0] << ", " << stats.min[1] << ", " << stats.min[2] << ") to ("
+                  << stats.max[0] << ", " << stats.max[1] << ", " << stats.max[2] << "), extent "
+                  << stats.max[0] - stats.min[0] + 1 << " x " << stats.max[1] - stats.min[1] + 1 << " x "
+                  << stats.max[2] - stats.min[2] + 1 << std::endl;
+    }
+
+    // A scene stores identical subtrees once, just like a DAG would
+    Scene scene;
+    scene.addModel(octree);
+
+    size_t sharedNodes = scene.getNodes().size() - 1;
+    size_t sharedBytes = sharedNodes * sizeof(Node) + scene.getBricks().size() * sizeof(uint);
+
+    std::cout << "dag: " << sharedNodes << " nodes, " << sharedBytes << " bytes, "
+              << double(bytes) / std::max<size_t>(sharedBytes, 1) << "x smaller" << std::endl;
+    std::cout << std::defaultfloat << std::setprecision(6);
+}
+
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: " << argv[0] << " <file.vox|file.svo>" << std::endl;
+        return 1;
+    }
+
+    std::string path = argv[1];
+
+    try {
+        if (path.size() >= 4 && path.compare(path.size() - 4, 4, ".svo") == 0) {
+            Octree octree = loadSvo(path);
+            std::cout << std::endl << "brick level " << int(octree.getBrickLevel()) << std::endl;
+            printStats(octree);
+            return 0;
+        }
+
+        VoxFile vox = readVox(path);
+
+        size_t voxelCount = 0;
+        for (const VoxModel& model : vox.models) voxelCount += model.voxels.size();
+
+        std::cout << path << ": " << vox.models.size() << " model(s) with " << voxelCount << " voxel(s) in "
+                  << vox.instances.size() << " instance(s)" << std::endl;
+
+        for (uchar brickLevel : BRICK_LEVELS) {
+            Octree octree = buildVoxOctree(vox, brickLevel);
+            std::cout << std::endl << "brick level " << int(brickLevel) << std::endl;
+            printStats(octree);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}